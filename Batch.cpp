@@ -0,0 +1,298 @@
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Batch.h"
+#include "FileSystem.h"
+#include "Helper.h"
+#include "Script.h"
+
+using namespace std;
+
+namespace
+{
+
+struct Job
+{
+    string script;
+    string disk;
+    string out; // Captured stdout, until it is written
+    string err; // Captured stderr, until it is written
+    bool done;
+};
+
+// Task queue of one thread, the owner takes from the front and thieves from the back
+struct TaskQueue
+{
+    mutex lock;
+    deque<size_t> tasks;
+};
+
+class Batch
+{
+public:
+    Batch(vector<Job> &jobs, const vector<vector<size_t>> &tasks, size_t threads, const BatchSettings &settings)
+        : jobs(jobs), tasks(tasks), settings(settings), queues(threads), next(0), commands(0)
+    {
+        // Round robin, stealing evens out tasks of different lengths
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            queues[i % threads].tasks.push_back(i);
+        }
+    }
+
+    void work(size_t self)
+    {
+        size_t task;
+        while (take(self, task))
+        {
+            for (size_t i = 0; i < tasks[task].size(); i++)
+            {
+                run(tasks[task][i]);
+            }
+        }
+    }
+
+    uint64_t commandCount() const { return commands; }
+
+private:
+    bool take(size_t self, size_t &task)
+    {
+        for (size_t i = 0; i < queues.size(); i++)
+        {
+            TaskQueue &queue = queues[(self + i) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+            {
+                continue;
+            }
+            if (i == 0)
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            else
+            {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t index)
+    {
+        Job &job = jobs[index];
+        ostringstream out;
+        ostringstream err;
+
+        // A fresh instance, as in a process of its own
+        {
+            FileSystem fs;
+            fs.setOutput(out, err);
+            settings.apply(fs);
+            ifstream script(job.script.c_str());
+            if (!script.is_open())
+            {
+                err << "Disk is not opened." << endl;
+            }
+            if (settings.batchWrites)
+            {
+                fs.batchBegin();
+            }
+            commands += runScript(fs, script, job.script.c_str(), err);
+            if (settings.batchWrites)
+            {
+                fs.batchEnd();
+            }
+            fs.unmount();
+            if (settings.metrics != nullptr)
+            {
+                settings.metrics->add(fs.metrics());
+            }
+        }
+
+        lock_guard<mutex> guard(output);
+        job.out = out.str();
+        job.err = err.str();
+        job.done = true;
+
+        // Write every finished job that has no unfinished job before it
+        while (next < jobs.size() && jobs[next].done)
+        {
+            cout << jobs[next].out;
+            cerr << jobs[next].err;
+            string().swap(jobs[next].out);
+            string().swap(jobs[next].err);
+            next++;
+        }
+        cout.flush();
+    }
+
+    vector<Job> &jobs;
+    const vector<vector<size_t>> &tasks;
+    const BatchSettings &settings;
+    vector<TaskQueue> queues;
+
+    mutex output; // Writing of the captured output
+    size_t next;  // First job whose output is not written yet
+    atomic<uint64_t> commands;
+};
+
+// Reads the jobs of a manifest, false after printing the error
+bool readManifest(const char *manifest, vector<Job> &jobs)
+{
+    ifstream file(manifest);
+    if (!file.is_open())
+    {
+        cerr << "Error: Cannot open manifest " << manifest << endl;
+        return false;
+    }
+
+    string line;
+    int line_counter = 0;
+    while (getline(file, line))
+    {
+        line_counter++;
+        vector<string> fields = tokenize(line, " \t");
+        if (fields.empty() || fields[0][0] == '#')
+        {
+            continue;
+        }
+        if (fields.size() != 2)
+        {
+            cerr << "Error: Bad manifest line " << manifest << ", " << line_counter << endl;
+            return false;
+        }
+        Job job;
+        job.script = fields[0];
+        job.disk = fields[1];
+        job.done = false;
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Disks the script of job mounts, read before it runs
+void mountedDisks(const Job &job, vector<string> &disks)
+{
+    ifstream file(job.script.c_str());
+    if (!file.is_open())
+    {
+        return;
+    }
+    ScriptReader reader(file);
+    Command command;
+    while (reader.next(command))
+    {
+        if (command.op == Command::MOUNT)
+        {
+            disks.push_back(string(command.text, command.size));
+        }
+    }
+}
+
+// One name for every path of an existing image, so d1 and ./d1 are the same disk
+string diskKey(const string &disk)
+{
+    char path[PATH_MAX];
+    return realpath(disk.c_str(), path) != nullptr ? string(path) : disk;
+}
+
+// Root of the group of job, halving the path on the way
+size_t groupOf(vector<size_t> &parent, size_t job)
+{
+    while (parent[job] != job)
+    {
+        parent[job] = parent[parent[job]];
+        job = parent[job];
+    }
+    return job;
+}
+
+} // namespace
+
+void BatchSettings::apply(FileSystem &fs) const
+{
+    fs.setMountMmap(mountMmap);
+    fs.setMountSnapshot(mountSnapshot);
+    fs.setDeferredZero(deferredZero);
+    if (cache)
+    {
+        fs.setCacheCapacity(cacheCapacity);
+    }
+}
+
+int runBatch(const char *manifest, int threads, const BatchSettings &settings)
+{
+    vector<Job> jobs;
+    if (!readManifest(manifest, jobs))
+    {
+        return 1;
+    }
+
+    // Jobs that touch a common disk, the one of the manifest or one their scripts mount,
+    // directly or through other jobs, form one task with its jobs in manifest order
+    vector<size_t> parent(jobs.size());
+    map<string, size_t> firstJob;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        parent[i] = i;
+        vector<string> disks(1, jobs[i].disk);
+        mountedDisks(jobs[i], disks);
+        for (size_t d = 0; d < disks.size(); d++)
+        {
+            map<string, size_t>::iterator it = firstJob.insert(make_pair(diskKey(disks[d]), i)).first;
+            parent[groupOf(parent, i)] = groupOf(parent, it->second);
+        }
+    }
+
+    vector<vector<size_t>> tasks;
+    map<size_t, size_t> taskOf;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        map<size_t, size_t>::iterator it = taskOf.find(groupOf(parent, i));
+        if (it == taskOf.end())
+        {
+            it = taskOf.insert(make_pair(groupOf(parent, i), tasks.size())).first;
+            tasks.push_back(vector<size_t>());
+        }
+        tasks[it->second].push_back(i);
+    }
+
+    size_t count = threads > 0 ? (size_t)threads : thread::hardware_concurrency();
+    count = max((size_t)1, min(count, tasks.size()));
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Batch batch(jobs, tasks, count, settings);
+    vector<thread> pool;
+    for (size_t i = 1; i < count; i++)
+    {
+        pool.push_back(thread(&Batch::work, &batch, i));
+    }
+    batch.work(0);
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+        pool[i].join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    char report[160];
+    snprintf(report, sizeof(report), "Batch: %zu jobs, %llu commands in %.3f s, %.0f commands/s, %zu threads",
+             jobs.size(), (unsigned long long)batch.commandCount(), seconds,
+             seconds > 0 ? batch.commandCount() / seconds : 0.0, count);
+    cerr << report << endl;
+    return 0;
+}
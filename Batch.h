@@ -0,0 +1,46 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstddef>
+
+class FileSystem;
+class Metrics;
+
+/**
+ * Settings of the FileSystem of every job, the FS_* options of ./fs
+ */
+struct BatchSettings
+{
+    bool mountMmap = false;      // FileSystem::setMountMmap
+    bool mountSnapshot = false;  // FileSystem::setMountSnapshot
+    bool deferredZero = false;   // FileSystem::setDeferredZero
+    bool cache = false;          // FileSystem::setCacheCapacity(cacheCapacity), when set
+    size_t cacheCapacity = 0;
+    bool batchWrites = false;    // The whole script runs between batchBegin() and batchEnd()
+    Metrics *metrics = nullptr;  // Adds the counters of every job, when given
+
+    // Applies the settings to fs, all but batchWrites and metrics
+    void apply(FileSystem &fs) const;
+};
+
+/**
+ * Batch mode of fs: runs the scripts of a manifest in one process on threads threads
+ * (the number of cores when threads is 0 or less).
+ *
+ * The manifest has one job per line, "<script> <disk>"; blank lines and lines starting
+ * with # are skipped. Every job runs its script on a FileSystem of its own, exactly as
+ * ./fs <script> would from the same directory. The scripts choose their disks with their
+ * M lines, which are read before the run: jobs that touch a common disk (the one of the
+ * manifest or one their scripts mount, directly or through other jobs) run one after the
+ * other in manifest order, the others run on a work-stealing pool: every thread takes
+ * jobs from its own queue and steals from the back of the others once it is empty.
+ *
+ * Every job's FileSystem gets settings before its script runs, and its counters are added
+ * to settings.metrics when it ends. The stdout and stderr of each job are captured and
+ * written in manifest order, so they read like the serial runs one after the other. The
+ * number of jobs and commands, the time and the commands per second go to stderr at the end.
+ * Returns the exit status, 1 if the manifest cannot be read.
+ */
+int runBatch(const char *manifest, int threads, const BatchSettings &settings);
+
+#endif
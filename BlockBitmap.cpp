@@ -0,0 +1,221 @@
+#include <cstring>
+
+#include "BlockBitmap.h"
+
+using namespace std;
+
+// Reverse the bit order of a byte, block 0 is the MSB on disk and the LSB in memory
+static inline uint8_t reverseByte(uint8_t b)
+{
+    b = (uint8_t)((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+    b = (uint8_t)((b & 0xCC) >> 2 | (b & 0x33) << 2);
+    b = (uint8_t)((b & 0xAA) >> 1 | (b & 0x55) << 1);
+    return b;
+}
+
+BlockBitmap::BlockBitmap() : blocks(0)
+{
+}
+
+BlockBitmap::BlockBitmap(size_t blocks)
+{
+    reset(blocks);
+}
+
+uint64_t BlockBitmap::mask(size_t lo, size_t hi)
+{
+    uint64_t high = (hi == 64) ? ~0ULL : ((1ULL << hi) - 1);
+    return high & ~((1ULL << lo) - 1);
+}
+
+void BlockBitmap::reset(size_t blocks)
+{
+    this->blocks = blocks;
+    words.assign((blocks + 63) / 64, 0);
+}
+
+void BlockBitmap::load(const char *bytes, size_t blocks)
+{
+    reset(blocks);
+    size_t nbytes = (blocks + 7) / 8;
+    for (size_t i = 0; i < nbytes; i++)
+    {
+        uint64_t lane = reverseByte((uint8_t)bytes[i]);
+        words[i / 8] |= lane << (8 * (i % 8));
+    }
+
+    // Drop bits past the last block so they never count as used
+    if (blocks % 64 != 0)
+    {
+        words.back() &= mask(0, blocks % 64);
+    }
+}
+
+void BlockBitmap::store(char *bytes) const
+{
+    store(bytes, 0, (blocks + 7) / 8);
+}
+
+void BlockBitmap::store(char *bytes, size_t first, size_t count) const
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t byte = first + i;
+        bytes[i] = (char)reverseByte((uint8_t)(words[byte / 8] >> (8 * (byte % 8))));
+    }
+}
+
+bool BlockBitmap::test(size_t block) const
+{
+    if (block >= blocks)
+    {
+        return false;
+    }
+    return (words[block / 64] >> (block % 64)) & 1;
+}
+
+void BlockBitmap::set(size_t start, size_t end)
+{
+    if (end > blocks)
+    {
+        end = blocks;
+    }
+    if (start >= end)
+    {
+        return;
+    }
+
+    size_t first = start / 64;
+    size_t last = (end - 1) / 64;
+    if (first == last)
+    {
+        words[first] |= mask(start % 64, (end - 1) % 64 + 1);
+        return;
+    }
+    words[first] |= mask(start % 64, 64);
+    for (size_t w = first + 1; w < last; w++)
+    {
+        words[w] = ~0ULL;
+    }
+    words[last] |= mask(0, (end - 1) % 64 + 1);
+}
+
+void BlockBitmap::clear(size_t start, size_t end)
+{
+    if (end > blocks)
+    {
+        end = blocks;
+    }
+    if (start >= end)
+    {
+        return;
+    }
+
+    size_t first = start / 64;
+    size_t last = (end - 1) / 64;
+    if (first == last)
+    {
+        words[first] &= ~mask(start % 64, (end - 1) % 64 + 1);
+        return;
+    }
+    words[first] &= ~mask(start % 64, 64);
+    for (size_t w = first + 1; w < last; w++)
+    {
+        words[w] = 0;
+    }
+    words[last] &= ~mask(0, (end - 1) % 64 + 1);
+}
+
+bool BlockBitmap::any(size_t start, size_t end) const
+{
+    if (end > blocks)
+    {
+        end = blocks;
+    }
+    if (start >= end)
+    {
+        return false;
+    }
+    return nextSet(start) < end;
+}
+
+size_t BlockBitmap::count() const
+{
+    size_t total = 0;
+    for (size_t w = 0; w < words.size(); w++)
+    {
+        total += __builtin_popcountll(words[w]);
+    }
+    return total;
+}
+
+size_t BlockBitmap::nextSet(size_t from) const
+{
+    if (from >= blocks)
+    {
+        return blocks;
+    }
+
+    size_t w = from / 64;
+    uint64_t bits = words[w] & mask(from % 64, 64);
+    while (bits == 0)
+    {
+        w++;
+        if (w == words.size())
+        {
+            return blocks;
+        }
+        bits = words[w];
+    }
+    size_t block = w * 64 + __builtin_ctzll(bits);
+    return block < blocks ? block : blocks;
+}
+
+size_t BlockBitmap::nextClear(size_t from) const
+{
+    if (from >= blocks)
+    {
+        return blocks;
+    }
+
+    size_t w = from / 64;
+    uint64_t bits = ~words[w] & mask(from % 64, 64);
+    while (bits == 0)
+    {
+        w++;
+        if (w == words.size())
+        {
+            return blocks;
+        }
+        bits = ~words[w];
+    }
+    size_t block = w * 64 + __builtin_ctzll(bits);
+    return block < blocks ? block : blocks;
+}
+
+size_t BlockBitmap::nextRun(size_t from, size_t &length) const
+{
+    size_t start = nextClear(from);
+    length = nextSet(start) - start;
+    return start;
+}
+
+long BlockBitmap::firstFit(size_t from, size_t size) const
+{
+    size_t length = 0;
+    size_t start = nextRun(from, length);
+    while (start < blocks)
+    {
+        if (length >= size)
+        {
+            return (long)start;
+        }
+        start = nextRun(start + length, length);
+    }
+    return -1;
+}
+
+bool BlockBitmap::operator==(const BlockBitmap &other) const
+{
+    return blocks == other.blocks && words == other.words;
+}
@@ -0,0 +1,81 @@
+#ifndef BLOCK_BITMAP_H
+#define BLOCK_BITMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Free-space bitmap kept in 64-bit words. Block i lives in word i / 64 at
+ * bit i % 64, so ranges are set and cleared with masks and runs are found
+ * with count-trailing-zeros instead of walking single bits.
+ *
+ * The on-disk free_block_list stores block 0 in the most significant bit of
+ * byte 0. load() and store() convert between the two layouts, the bytes on
+ * disk are unchanged.
+ */
+class BlockBitmap
+{
+public:
+    BlockBitmap();
+    explicit BlockBitmap(size_t blocks);
+
+    // Number of blocks tracked
+    size_t size() const { return blocks; }
+
+    // Resize to blocks and clear every bit
+    void reset(size_t blocks);
+
+    // Read blocks bits from the on-disk byte layout
+    void load(const char *bytes, size_t blocks);
+
+    // Write the bitmap in the on-disk byte layout, (size() + 7) / 8 bytes
+    void store(char *bytes) const;
+
+    // Write count bytes of the on-disk layout starting at byte first
+    void store(char *bytes, size_t first, size_t count) const;
+
+    // Returns true if block is in use
+    bool test(size_t block) const;
+
+    // Sets blocks [start, end) to in use
+    void set(size_t start, size_t end);
+
+    // Sets blocks [start, end) to free
+    void clear(size_t start, size_t end);
+
+    // Returns true if any block in [start, end) is in use
+    bool any(size_t start, size_t end) const;
+
+    // Number of blocks in use
+    size_t count() const;
+
+    // First block >= from that is in use, size() if there is none
+    size_t nextSet(size_t from) const;
+
+    // First block >= from that is free, size() if there is none
+    size_t nextClear(size_t from) const;
+
+    // Start of the first free run at or after from, length is set to its size.
+    // Returns size() if there are no more free blocks.
+    size_t nextRun(size_t from, size_t &length) const;
+
+    // Start of the first free run at or after from that holds at least size
+    // blocks, -1 if there is none
+    long firstFit(size_t from, size_t size) const;
+
+    // The 64-bit words, bits past size() are clear
+    const std::vector<uint64_t> &data() const { return words; }
+
+    bool operator==(const BlockBitmap &other) const;
+    bool operator!=(const BlockBitmap &other) const { return !(*this == other); }
+
+private:
+    // Mask of the bits [lo, hi) inside a single word, 0 <= lo < hi <= 64
+    static uint64_t mask(size_t lo, size_t hi);
+
+    size_t blocks;
+    std::vector<uint64_t> words;
+};
+
+#endif
@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <cstring>
+
+#include "BlockCache.h"
+#include "Timeline.h"
+
+using namespace std;
+
+BlockCache::BlockCache(size_t capacity) : disk(nullptr), hand(0)
+{
+    frames.resize(capacity);
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        frames[i].valid = false;
+    }
+    bytes.resize(capacity * 1024);
+    resetStats();
+}
+
+bool BlockCache::setCapacity(size_t capacity)
+{
+    if (!flush())
+    {
+        return false;
+    }
+    index.clear();
+    hand = 0;
+    frames.assign(capacity, Frame());
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        frames[i].valid = false;
+    }
+    bytes.assign(capacity * 1024, 0);
+    return true;
+}
+
+bool BlockCache::attach(Disk *disk)
+{
+    if (!flush())
+    {
+        return false;
+    }
+    index.clear();
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        frames[i].valid = false;
+    }
+    this->disk = disk;
+    return true;
+}
+
+void BlockCache::resetStats()
+{
+    memset(&counters, 0, sizeof(counters));
+    direct = 0;
+}
+
+BlockCache::Stats BlockCache::stats() const
+{
+    Stats total = counters;
+    total.misses += direct;
+    return total;
+}
+
+long BlockCache::frameFor(uint64_t block, bool &cached)
+{
+    unordered_map<uint64_t, size_t>::iterator it = index.find(block);
+    if (it != index.end())
+    {
+        counters.hits++;
+        frames[it->second].referenced = true;
+        cached = true;
+        return (long)it->second;
+    }
+    counters.misses++;
+    cached = false;
+
+    // CLOCK: skip frames used since the last sweep, take an empty or cold one
+    while (frames[hand].valid && frames[hand].referenced)
+    {
+        frames[hand].referenced = false;
+        hand = (hand + 1) % frames.size();
+    }
+    size_t victim = hand;
+    Frame &frame = frames[victim];
+    if (frame.valid)
+    {
+        if (frame.dirty)
+        {
+            if (!disk->write((off_t)frame.block * 1024, data(victim), 1024))
+            {
+                return -1;
+            }
+            counters.writebacks++;
+        }
+        index.erase(frame.block);
+        counters.evictions++;
+    }
+    hand = (hand + 1) % frames.size();
+
+    frame.block = block;
+    frame.valid = true;
+    frame.dirty = false;
+    frame.referenced = true;
+    index[block] = victim;
+    return (long)victim;
+}
+
+bool BlockCache::read(uint64_t block, char *buffer)
+{
+    if (bypass())
+    {
+        direct++;
+        return disk->read((off_t)block * 1024, buffer, 1024);
+    }
+
+    bool cached;
+    long frame = frameFor(block, cached);
+    if (frame < 0)
+    {
+        return false;
+    }
+    if (!cached && !disk->read((off_t)block * 1024, data(frame), 1024))
+    {
+        index.erase(block);
+        frames[frame].valid = false;
+        return false;
+    }
+    memcpy(buffer, data(frame), 1024);
+    return true;
+}
+
+bool BlockCache::write(uint64_t block, const char *buffer)
+{
+    if (bypass())
+    {
+        direct++;
+        return disk->write((off_t)block * 1024, buffer, 1024);
+    }
+
+    // The whole block is replaced, a miss does not read it first
+    bool cached;
+    long frame = frameFor(block, cached);
+    if (frame < 0)
+    {
+        return false;
+    }
+    memcpy(data(frame), buffer, 1024);
+    frames[frame].dirty = true;
+    return true;
+}
+
+bool BlockCache::readRange(uint64_t block, uint64_t count, char *buffer)
+{
+    if (count == 1)
+    {
+        return read(block, buffer);
+    }
+    if (!disk->read((off_t)block * 1024, buffer, count * 1024))
+    {
+        return false;
+    }
+    if (bypass())
+    {
+        direct += count;
+        return true;
+    }
+
+    // The cached blocks may be newer than the disk. A short run looks its blocks up,
+    // a run longer than the cache scans the frames.
+    uint64_t cached = 0;
+    if (count < frames.size())
+    {
+        for (uint64_t i = 0; i < count; i++)
+        {
+            unordered_map<uint64_t, size_t>::const_iterator it = index.find(block + i);
+            if (it != index.end())
+            {
+                memcpy(buffer + i * 1024, data(it->second), 1024);
+                cached++;
+            }
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            if (frames[i].valid && frames[i].block >= block && frames[i].block - block < count)
+            {
+                memcpy(buffer + (frames[i].block - block) * 1024, data(i), 1024);
+                cached++;
+            }
+        }
+    }
+    counters.hits += cached;
+    counters.misses += count - cached;
+    return true;
+}
+
+bool BlockCache::writeRange(uint64_t block, uint64_t count, const char *buffer)
+{
+    if (count == 1)
+    {
+        return write(block, buffer);
+    }
+    if (bypass())
+    {
+        direct += count;
+    }
+    else
+    {
+        drop(block, count);
+        counters.misses += count;
+    }
+    return disk->write((off_t)block * 1024, buffer, count * 1024);
+}
+
+void BlockCache::drop(uint64_t first, uint64_t count)
+{
+    if (count < frames.size())
+    {
+        for (uint64_t i = 0; i < count; i++)
+        {
+            unordered_map<uint64_t, size_t>::iterator it = index.find(first + i);
+            if (it != index.end())
+            {
+                frames[it->second].valid = false;
+                index.erase(it);
+            }
+        }
+        return;
+    }
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        if (frames[i].valid && frames[i].block >= first && frames[i].block - first < count)
+        {
+            index.erase(frames[i].block);
+            frames[i].valid = false;
+        }
+    }
+}
+
+bool BlockCache::zero(uint64_t block, uint64_t count)
+{
+    if (count == 1)
+    {
+        static const char zeros[1024] = {0};
+        return write(block, zeros);
+    }
+
+    // A range goes to the disk in one call
+    drop(block, count);
+    return disk->zero((off_t)block * 1024, count * 1024);
+}
+
+bool BlockCache::move(uint64_t src, uint64_t dst, uint64_t count)
+{
+    if (src == dst || count == 0)
+    {
+        return true;
+    }
+    Timeline::Span span("move");
+    span.arg("from", src);
+    span.arg("to", dst);
+    span.arg("blocks", count);
+
+    // Cached destination blocks are overwritten, cached source blocks are renamed after the move
+    vector<size_t> moved;
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        if (!frames[i].valid)
+        {
+            continue;
+        }
+        if (frames[i].block >= src && frames[i].block - src < count)
+        {
+            moved.push_back(i);
+            index.erase(frames[i].block);
+        }
+        else if (frames[i].block >= dst && frames[i].block - dst < count)
+        {
+            index.erase(frames[i].block);
+            frames[i].valid = false;
+        }
+    }
+
+    if (!disk->move((off_t)src * 1024, (off_t)dst * 1024, count * 1024))
+    {
+        // Keep the cached source blocks where they were
+        for (size_t i = 0; i < moved.size(); i++)
+        {
+            index[frames[moved[i]].block] = moved[i];
+        }
+        return false;
+    }
+
+    for (size_t i = 0; i < moved.size(); i++)
+    {
+        Frame &frame = frames[moved[i]];
+        frame.block = frame.block - src + dst;
+        index[frame.block] = moved[i];
+    }
+    return true;
+}
+
+bool BlockCache::flush()
+{
+    vector<pair<uint64_t, size_t>> dirty;
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        if (frames[i].valid && frames[i].dirty)
+        {
+            dirty.push_back(make_pair(frames[i].block, i));
+        }
+    }
+    sort(dirty.begin(), dirty.end());
+
+    // One pwrite per run of consecutive blocks
+    vector<char> run;
+    size_t first = 0;
+    while (first < dirty.size())
+    {
+        size_t last = first + 1;
+        while (last < dirty.size() && dirty[last].first == dirty[last - 1].first + 1)
+        {
+            last++;
+        }
+
+        run.resize((last - first) * 1024);
+        for (size_t i = first; i < last; i++)
+        {
+            memcpy(&run[(i - first) * 1024], data(dirty[i].second), 1024);
+        }
+        if (!disk->write((off_t)dirty[first].first * 1024, run.data(), run.size()))
+        {
+            return false;
+        }
+        for (size_t i = first; i < last; i++)
+        {
+            frames[dirty[i].second].dirty = false;
+        }
+        counters.writebacks += last - first;
+        first = last;
+    }
+    return true;
+}
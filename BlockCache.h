@@ -0,0 +1,104 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "Disk.h"
+
+/**
+ * Write-back cache of 1KB data blocks in front of a Disk.
+ *
+ * A fixed number of frames is replaced with CLOCK: every hit sets the
+ * frame's reference bit and the hand clears bits until it finds a frame
+ * that was not used since its last sweep. Writes only mark the frame
+ * dirty; dirty frames go to disk when they are evicted or on flush(),
+ * which writes runs of consecutive blocks with a single write.
+ *
+ * A capacity of 0 turns the cache off, every access goes to the disk.
+ * A mapped disk is never cached, its accesses are already memory copies.
+ * Only then may several threads use the cache at once, each on its own blocks.
+ */
+class BlockCache
+{
+public:
+    typedef struct {
+        uint64_t hits;       // Accesses served from a frame
+        uint64_t misses;     // Accesses that needed a frame
+        uint64_t evictions;  // Frames taken from another block
+        uint64_t writebacks; // Dirty blocks written to disk
+    } Stats;
+
+    explicit BlockCache(size_t capacity = 256);
+
+    // Number of frames
+    size_t capacity() const { return frames.size(); }
+
+    // Writes back and drops every block, then keeps capacity frames
+    bool setCapacity(size_t capacity);
+
+    // Writes back the blocks of the previous disk and starts caching disk
+    bool attach(Disk *disk);
+
+    // Copies block into buffer (1KB), false if the disk cannot be read
+    bool read(uint64_t block, char *buffer);
+
+    // Replaces block with buffer (1KB), false if a write back failed
+    bool write(uint64_t block, const char *buffer);
+
+    // Copies count blocks from block into buffer (count KB) with one disk read,
+    // blocks still dirty in the cache are taken from their frame
+    bool readRange(uint64_t block, uint64_t count, char *buffer);
+
+    // Replaces count blocks from block with buffer (count KB) with one disk write,
+    // the cached copies of those blocks are dropped
+    bool writeRange(uint64_t block, uint64_t count, const char *buffer);
+
+    // Replaces count blocks from block with zeros
+    bool zero(uint64_t block, uint64_t count = 1);
+
+    // Moves count blocks from src to dst with one disk move, the ranges may
+    // overlap. Cached source blocks are renamed to their new block, so
+    // they stay cached and dirty ones are not written first.
+    bool move(uint64_t src, uint64_t dst, uint64_t count);
+
+    // Writes every dirty block to disk, false if the disk cannot be written
+    bool flush();
+
+    Stats stats() const;
+    void resetStats();
+
+private:
+    struct Frame
+    {
+        uint64_t block;
+        bool valid;
+        bool dirty;
+        bool referenced;
+    };
+
+    // Frame holding block, a new one (maybe evicted) if it is not cached.
+    // Returns -1 if the evicted block cannot be written back.
+    long frameFor(uint64_t block, bool &cached);
+
+    // Frees the frames of blocks [first, first + count)
+    void drop(uint64_t first, uint64_t count);
+
+    char *data(size_t frame) { return &bytes[frame * 1024]; }
+
+    // True if accesses go straight to the disk
+    bool bypass() const { return frames.empty() || disk->mapped() != nullptr; }
+
+    Disk *disk;
+    size_t hand;
+    std::vector<Frame> frames;
+    std::vector<char> bytes;
+    std::unordered_map<uint64_t, size_t> index;
+    Stats counters;
+    std::atomic<uint64_t> direct; // Accesses that went straight to the disk
+};
+
+#endif
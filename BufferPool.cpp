@@ -0,0 +1,58 @@
+#include <algorithm>
+#include <cstring>
+
+#include "BufferPool.h"
+
+using namespace std;
+
+BufferPool::BufferPool(size_t slots) : slots(slots)
+{
+    for (size_t i = 0; i < this->slots.size(); i++)
+    {
+        this->slots[i].bytes.assign(1024, 0);
+        this->slots[i].blocks = 1;
+    }
+}
+
+void BufferPool::reserve(vector<char> &bytes, size_t blocks)
+{
+    if (bytes.size() >= blocks * 1024)
+    {
+        return;
+    }
+    size_t capacity = max(bytes.size(), (size_t)1024);
+    while (capacity < blocks * 1024)
+    {
+        capacity *= 2;
+    }
+    bytes.resize(capacity, 0);
+}
+
+char *BufferPool::resize(size_t slot, size_t blocks)
+{
+    Slot &buffer = slots[slot];
+    reserve(buffer.bytes, blocks);
+    if (blocks > buffer.blocks)
+    {
+        memset(&buffer.bytes[buffer.blocks * 1024], 0, (blocks - buffer.blocks) * 1024);
+    }
+    buffer.blocks = blocks;
+    return buffer.bytes.data();
+}
+
+const char *BufferPool::repeat(size_t slot, size_t blocks)
+{
+    Slot &buffer = slots[slot];
+    if (blocks <= buffer.blocks)
+    {
+        return buffer.bytes.data();
+    }
+
+    reserve(buffer.scratch, blocks);
+    size_t length = buffer.blocks * 1024;
+    for (size_t i = 0; i < blocks * 1024; i += length)
+    {
+        memcpy(&buffer.scratch[i], buffer.bytes.data(), min(length, blocks * 1024 - i));
+    }
+    return buffer.scratch.data();
+}
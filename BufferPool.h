@@ -0,0 +1,51 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Numbered I/O buffers of whole 1KB blocks.
+ *
+ * Every slot holds a run of blocks and can grow past one block. The
+ * memory of a slot is kept when its contents shrink and grows in powers
+ * of two, so once a workload has reached its largest runs the commands
+ * using the slots no longer allocate.
+ */
+class BufferPool
+{
+public:
+    explicit BufferPool(size_t slots);
+
+    // Number of slots
+    size_t size() const { return slots.size(); }
+
+    // Blocks held by slot
+    size_t blocks(size_t slot) const { return slots[slot].blocks; }
+
+    // Start of slot's blocks
+    char *data(size_t slot) { return slots[slot].bytes.data(); }
+
+    // Makes slot hold blocks blocks and returns its start. The contents are
+    // kept up to the old size, the blocks past it are zeros.
+    char *resize(size_t slot, size_t blocks);
+
+    // The first blocks blocks of slot, its contents repeated if it holds fewer.
+    // Slots are independent, threads can use different slots at once.
+    const char *repeat(size_t slot, size_t blocks);
+
+private:
+    struct Slot
+    {
+        std::vector<char> bytes;
+        size_t blocks;
+        std::vector<char> scratch; // Repeated contents for repeat()
+    };
+
+    // Grows bytes to hold at least blocks blocks
+    static void reserve(std::vector<char> &bytes, size_t blocks);
+
+    std::vector<Slot> slots;
+};
+
+#endif
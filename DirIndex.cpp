@@ -0,0 +1,111 @@
+#include "DirIndex.h"
+
+using namespace std;
+
+uint64_t DirIndex::key(const char name[5])
+{
+    // Same match as strncmp(a, b, 5)
+    uint64_t packed = 0;
+    for (int i = 0; i < 5 && name[i] != '\0'; i++)
+    {
+        packed |= (uint64_t)(unsigned char)name[i] << (8 * i);
+    }
+    return packed;
+}
+
+void DirIndex::clear()
+{
+    directories.clear();
+}
+
+void DirIndex::addDirectory(uint32_t dir, size_t entries)
+{
+    Directory &directory = directories[dir];
+    if (directory.names.empty())
+    {
+        directory.names.reserve(entries);
+    }
+}
+
+void DirIndex::removeDirectory(uint32_t dir)
+{
+    directories.erase(dir);
+}
+
+bool DirIndex::isDirectory(uint32_t dir) const
+{
+    return directories.count(dir) > 0;
+}
+
+void DirIndex::insert(uint32_t dir, const char name[5], int inode)
+{
+    Directory &directory = directories[dir];
+    list<int>::iterator it = directory.entries.insert(directory.entries.end(), inode);
+
+    // The first entry keeps the name if a corrupted disk has two
+    directory.names.insert(make_pair(key(name), it));
+}
+
+void DirIndex::erase(uint32_t dir, const char name[5], int inode)
+{
+    unordered_map<uint32_t, Directory>::iterator found = directories.find(dir);
+    if (found == directories.end())
+    {
+        return;
+    }
+
+    Directory &directory = found->second;
+    unordered_map<uint64_t, list<int>::iterator>::iterator it = directory.names.find(key(name));
+    if (it != directory.names.end() && *it->second == inode)
+    {
+        directory.entries.erase(it->second);
+        directory.names.erase(it);
+        return;
+    }
+
+    // Entry that lost its name to a duplicate
+    for (list<int>::iterator entry = directory.entries.begin(); entry != directory.entries.end(); entry++)
+    {
+        if (*entry == inode)
+        {
+            directory.entries.erase(entry);
+            return;
+        }
+    }
+}
+
+int DirIndex::lookup(uint32_t dir, const char name[5]) const
+{
+    unordered_map<uint32_t, Directory>::const_iterator found = directories.find(dir);
+    if (found == directories.end())
+    {
+        return -1;
+    }
+
+    unordered_map<uint64_t, list<int>::iterator>::const_iterator it = found->second.names.find(key(name));
+    if (it == found->second.names.end())
+    {
+        return -1;
+    }
+    return *it->second;
+}
+
+size_t DirIndex::count(uint32_t dir) const
+{
+    unordered_map<uint32_t, Directory>::const_iterator found = directories.find(dir);
+    if (found == directories.end())
+    {
+        return 0;
+    }
+    return found->second.entries.size();
+}
+
+const list<int> &DirIndex::children(uint32_t dir) const
+{
+    unordered_map<uint32_t, Directory>::const_iterator found = directories.find(dir);
+    if (found == directories.end())
+    {
+        return empty;
+    }
+    return found->second.entries;
+}
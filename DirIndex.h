@@ -0,0 +1,62 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Directory index of the mounted disk, keyed by the inode of each directory
+ * (the root directory uses the root value of the superblock).
+ *
+ * Every directory keeps its children in creation order for fs_ls, plus a hash
+ * table from the packed 5 byte name to the child, so a name lookup, a child
+ * count or a removal is O(1).
+ */
+class DirIndex
+{
+public:
+    // Drop every directory
+    void clear();
+
+    // Adds an empty directory with room for entries names, does nothing if it exists
+    void addDirectory(uint32_t dir, size_t entries = 0);
+
+    // Removes a directory and its entries, not its children's directories
+    void removeDirectory(uint32_t dir);
+
+    // Returns true if dir is an indexed directory
+    bool isDirectory(uint32_t dir) const;
+
+    // Adds inode to dir under name
+    void insert(uint32_t dir, const char name[5], int inode);
+
+    // Removes inode from dir
+    void erase(uint32_t dir, const char name[5], int inode);
+
+    // Returns the inode called name in dir, -1 if there is none
+    int lookup(uint32_t dir, const char name[5]) const;
+
+    // Number of entries in dir
+    size_t count(uint32_t dir) const;
+
+    // Entries of dir in creation order
+    const std::list<int> &children(uint32_t dir) const;
+
+    // Packs a name into an integer, bytes after the first '\0' are ignored
+    static uint64_t key(const char name[5]);
+
+private:
+    struct Directory
+    {
+        std::list<int> entries;
+        std::unordered_map<uint64_t, std::list<int>::iterator> names;
+    };
+
+    std::unordered_map<uint32_t, Directory> directories;
+    std::list<int> empty;
+};
+
+#endif
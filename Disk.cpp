@@ -0,0 +1,281 @@
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Disk.h"
+#include "Timeline.h"
+
+using namespace std;
+
+// Largest single pread/pwrite of a move or a zero fill
+static const size_t CHUNK = 1 << 20;
+
+Disk::~Disk()
+{
+    if (FD >= 0)
+    {
+        close(FD);
+    }
+}
+
+void Disk::count(Metrics::Kind kind, uint64_t start, off_t offset, size_t length)
+{
+    static const char *CALLS[Metrics::KINDS] = {"pread", "pwrite", "copy_file_range", "fallocate", "msync"};
+    static const char *MAPPED_CALLS[Metrics::KINDS] = {"memcpy read", "memcpy write", "memmove", "memset", "msync"};
+
+    uint64_t ns = Metrics::now() - start;
+    if (metrics != nullptr)
+    {
+        metrics->io(kind, ns, length);
+    }
+    if (Timeline::enabled())
+    {
+        Timeline::Event event = Timeline::Event();
+        event.name = mapped() != nullptr ? MAPPED_CALLS[kind] : CALLS[kind];
+        event.start = start;
+        event.duration = ns;
+        event.keys[0] = "offset";
+        event.values[0] = offset;
+        event.keys[1] = "bytes";
+        event.values[1] = (int64_t)length;
+        Timeline::add(event);
+    }
+}
+
+bool FileDisk::read(off_t offset, void *buffer, size_t length)
+{
+    uint64_t start = Metrics::now();
+    ssize_t count = pread(FD, buffer, length, offset);
+    if (count < 0)
+    {
+        return false;
+    }
+    this->count(Metrics::IO_READ, start, offset, count);
+    // Past the end of the image reads as zeros
+    memset((char *)buffer + count, 0, length - count);
+    return true;
+}
+
+bool FileDisk::write(off_t offset, const void *buffer, size_t length)
+{
+    uint64_t start = Metrics::now();
+    ssize_t count = pwrite(FD, buffer, length, offset);
+    this->count(Metrics::IO_WRITE, start, offset, count < 0 ? 0 : count);
+    return count == (ssize_t)length;
+}
+
+bool FileDisk::copyRange(off_t from, off_t to, size_t length)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    while (length > 0)
+    {
+        loff_t in = from;
+        loff_t out = to;
+        uint64_t start = Metrics::now();
+        ssize_t count = copy_file_range(FD, &in, FD, &out, length, 0);
+        if (count <= 0)
+        {
+            // Not supported here, the caller copies what is left
+            return false;
+        }
+        this->count(Metrics::IO_COPY, start, from, count);
+        from += count;
+        to += count;
+        length -= count;
+    }
+    return true;
+#else
+    (void)from;
+    (void)to;
+    return length == 0;
+#endif
+}
+
+bool FileDisk::move(off_t from, off_t to, size_t length)
+{
+    if (from == to || length == 0)
+    {
+        return true;
+    }
+
+    // The kernel rejects overlapping ranges of the same file
+    off_t distance = from < to ? to - from : from - to;
+    if ((size_t)distance >= length)
+    {
+        size_t done = 0;
+        while (done < length)
+        {
+            size_t count = min(CHUNK, length - done);
+            if (!copyRange(from + done, to + done, count))
+            {
+                break;
+            }
+            done += count;
+        }
+        if (done == length)
+        {
+            return true;
+        }
+        from += done;
+        to += done;
+        length -= done;
+    }
+
+    // Moving forward over itself copies from the end so no source byte is
+    // overwritten before it is read
+    vector<char> buffer(min(CHUNK, length));
+    size_t done = 0;
+    while (done < length)
+    {
+        size_t count = min(buffer.size(), length - done);
+        off_t at = to > from ? (off_t)(length - done - count) : (off_t)done;
+        if (!read(from + at, buffer.data(), count) || !write(to + at, buffer.data(), count))
+        {
+            return false;
+        }
+        done += count;
+    }
+    return true;
+}
+
+// fallocate errors that will not go away for this file
+static bool unsupported(int error)
+{
+    return error == EOPNOTSUPP || error == ENOSYS || error == EINVAL;
+}
+
+bool FileDisk::zeroRange(off_t offset, size_t length)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // A hole reads as zeros and gives the space back, the image keeps its size
+    if (punchHole)
+    {
+        uint64_t start = Metrics::now();
+        if (fallocate(FD, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        {
+            count(Metrics::IO_ZERO, start, offset, length);
+            return true;
+        }
+        punchHole = !unsupported(errno);
+    }
+#endif
+#ifdef FALLOC_FL_ZERO_RANGE
+    if (zeroMode)
+    {
+        uint64_t start = Metrics::now();
+        if (fallocate(FD, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        {
+            count(Metrics::IO_ZERO, start, offset, length);
+            return true;
+        }
+        zeroMode = !unsupported(errno);
+    }
+#endif
+    (void)offset;
+    (void)length;
+    return false;
+}
+
+bool FileDisk::zero(off_t offset, size_t length)
+{
+    if (length == 0 || zeroRange(offset, length))
+    {
+        return true;
+    }
+
+    vector<char> zeros(min(CHUNK, length), 0);
+    size_t done = 0;
+    while (done < length)
+    {
+        size_t count = min(zeros.size(), length - done);
+        if (!write(offset + done, zeros.data(), count))
+        {
+            return false;
+        }
+        done += count;
+    }
+    return true;
+}
+
+MappedDisk *MappedDisk::map(int FD, size_t length)
+{
+    // Touching a page past the end of the file would raise SIGBUS
+    struct stat info;
+    if (length == 0 || fstat(FD, &info) < 0 || (size_t)info.st_size < length)
+    {
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+    if (base == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    return new MappedDisk(FD, (char *)base, length);
+}
+
+MappedDisk::~MappedDisk()
+{
+    msync(base, length, MS_SYNC);
+    munmap(base, length);
+}
+
+bool MappedDisk::read(off_t offset, void *buffer, size_t length)
+{
+    if (offset < 0 || (size_t)offset + length > this->length)
+    {
+        return false;
+    }
+    uint64_t start = Metrics::now();
+    memcpy(buffer, base + offset, length);
+    count(Metrics::IO_READ, start, offset, length);
+    return true;
+}
+
+bool MappedDisk::write(off_t offset, const void *buffer, size_t length)
+{
+    if (offset < 0 || (size_t)offset + length > this->length)
+    {
+        return false;
+    }
+    uint64_t start = Metrics::now();
+    memcpy(base + offset, buffer, length);
+    count(Metrics::IO_WRITE, start, offset, length);
+    return true;
+}
+
+bool MappedDisk::move(off_t from, off_t to, size_t length)
+{
+    if (from < 0 || to < 0 || (size_t)from + length > this->length || (size_t)to + length > this->length)
+    {
+        return false;
+    }
+    uint64_t start = Metrics::now();
+    memmove(base + to, base + from, length);
+    count(Metrics::IO_COPY, start, from, length);
+    return true;
+}
+
+bool MappedDisk::zero(off_t offset, size_t length)
+{
+    if (offset < 0 || (size_t)offset + length > this->length)
+    {
+        return false;
+    }
+    uint64_t start = Metrics::now();
+    memset(base + offset, 0, length);
+    count(Metrics::IO_ZERO, start, offset, length);
+    return true;
+}
+
+bool MappedDisk::sync()
+{
+    uint64_t start = Metrics::now();
+    bool synced = msync(base, length, MS_SYNC) == 0;
+    count(Metrics::IO_SYNC, start, 0, 0);
+    return synced;
+}
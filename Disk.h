@@ -0,0 +1,103 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <cstddef>
+#include <sys/types.h>
+
+#include "Metrics.h"
+
+/**
+ * Backend of a mounted disk image. Offsets and lengths are in bytes.
+ *
+ * FileDisk reads and writes the descriptor with pread/pwrite and is the
+ * default, moves use copy_file_range when the kernel has it and chunks
+ * of up to 1MB otherwise. Zeroing punches a hole (or zeroes the range) with
+ * fallocate where the host file system supports it. MappedDisk maps the whole image: reads and writes are memcpy
+ * on the mapping and sync() is the msync that makes them durable.
+ *
+ * Every call is counted in the metrics set with setMetrics(), if any, and is an event
+ * of the timeline when it is recording.
+ */
+class Disk
+{
+public:
+    // Takes ownership of FD, closed with the disk
+    explicit Disk(int FD) : FD(FD) {}
+    virtual ~Disk();
+
+    int descriptor() const { return FD; }
+
+    // Hands FD over to the caller, the disk no longer closes it
+    int release() { int released = FD; FD = -1; return released; }
+
+    void setMetrics(Metrics *metrics) { this->metrics = metrics; }
+
+    // Start of the mapped image, nullptr if the disk is not mapped
+    virtual char *mapped() const { return nullptr; }
+
+    virtual bool read(off_t offset, void *buffer, size_t length) = 0;
+    virtual bool write(off_t offset, const void *buffer, size_t length) = 0;
+
+    // Copies length bytes from offset from to offset to, the ranges may overlap
+    virtual bool move(off_t from, off_t to, size_t length) = 0;
+
+    // Replaces length bytes at offset with zeros
+    virtual bool zero(off_t offset, size_t length) = 0;
+
+    // Makes the writes so far durable
+    virtual bool sync() = 0;
+
+protected:
+    // Counts a call of kind on length bytes at offset started at start (a Metrics::now() time)
+    void count(Metrics::Kind kind, uint64_t start, off_t offset, size_t length);
+
+    int FD;
+    Metrics *metrics = nullptr;
+};
+
+class FileDisk : public Disk
+{
+public:
+    explicit FileDisk(int FD) : Disk(FD) {}
+
+    bool read(off_t offset, void *buffer, size_t length);
+    bool write(off_t offset, const void *buffer, size_t length);
+    bool move(off_t from, off_t to, size_t length);
+    bool zero(off_t offset, size_t length);
+    bool sync() { return true; }
+
+private:
+    // copy_file_range in the kernel, false if it is not supported for FD
+    bool copyRange(off_t from, off_t to, size_t length);
+
+    // fallocate zeroing, false if the host file system supports neither mode
+    bool zeroRange(off_t offset, size_t length);
+
+    bool punchHole = true; // Cleared once the host file system rejects a mode
+    bool zeroMode = true;
+};
+
+class MappedDisk : public Disk
+{
+public:
+    // Maps the first length bytes of FD, nullptr if it cannot be mapped.
+    // FD is only taken over on success.
+    static MappedDisk *map(int FD, size_t length);
+    ~MappedDisk();
+
+    char *mapped() const { return base; }
+
+    bool read(off_t offset, void *buffer, size_t length);
+    bool write(off_t offset, const void *buffer, size_t length);
+    bool move(off_t from, off_t to, size_t length);
+    bool zero(off_t offset, size_t length);
+    bool sync();
+
+private:
+    MappedDisk(int FD, char *base, size_t length) : Disk(FD), base(base), length(length) {}
+
+    char *base;
+    size_t length;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <bitset>
@@ -17,348 +18,786 @@
 
 using namespace std;
 
-int check1(Super_block *super_block)
+// Name table slot of the consistency check, name 0 marks an empty slot
+typedef struct {
+    uint64_t name;
+    uint32_t parent;
+} NameSlot;
+
+// Name slots on the stack (128KB), enough for 4096 inodes. A larger inode table
+// takes its name table from the heap.
+static const size_t STACK_SLOTS = 8192;
+
+// The name as the directory index matches it (up to the first NUL), with bit 40 set so
+// no name packs to 0
+static uint64_t packName(const char name[5])
 {
-    // Represent the character array in binary form
-    bitset<128> inode_used_list(0);
+    return DirIndex::key(name) | 1ull << 40;
+}
 
-    // Check all Inode
-    for (size_t i = 0; i < 126; i++)
+// Adds name in parent to the table, false if it is already there
+static bool insertName(NameSlot *slots, size_t mask, uint64_t name, uint32_t parent)
+{
+    uint64_t hash = (name ^ (uint64_t)parent * 0x9E3779B97F4A7C15ull) * 0xBF58476D1CE4E5B9ull;
+    size_t i = (size_t)(hash ^ (hash >> 31)) & mask;
+    while (slots[i].name != 0)
     {
-        // Set bits between start_block til start_block + file_size
-        // Get start_block
-        int start = super_block->inode[i].start_block;
-
-        if (start <= 127)
+        if (slots[i].name == name && slots[i].parent == parent)
         {
-            int used_size = bitset<7>(super_block->inode[i].used_size).to_ulong();
-            int end = start + used_size;
-
-            for (int j = start; j < end; j++)
-            {
-                // Set j-th bit to 1, meaning occupied
-                // Check if it is already set, possible overlap
-                if (inode_used_list.test(j))
-                {
-                    // Overlap!
-                    return 0;
-                }
-                inode_used_list.set(j, 1);
-            }
+            return false;
         }
+        i = (i + 1) & mask;
     }
+    slots[i].name = name;
+    slots[i].parent = parent;
+    return true;
+}
 
-    // First bit must be one, for superblock
-    inode_used_list.set(0, 1);
-
-    string free_block_list;
-    // Convert bit value of chars to a single string
-    for (size_t i = 0; i < 16; i++)
+// Records a violation, lowest keeps the smallest code
+static void report(int code, uint32_t inode, int &lowest, vector<FS_violation> *violations)
+{
+    if (lowest == 0 || code < lowest)
     {
-        free_block_list.append(bitset<8>(super_block->free_block_list[i]).to_string());
+        lowest = code;
     }
-
-    reverse(free_block_list.begin(), free_block_list.end());
-
-    // If matches
-    if (free_block_list.compare(inode_used_list.to_string()) == 0)
+    if (violations != nullptr)
     {
-        return 1;
+        FS_violation violation = {code, inode};
+        violations->push_back(violation);
     }
+}
 
-    // Else
-    return 0;
+// Puts back the extents of inodes [0, count) that ccheck took out of the free-space list
+static void restoreExtents(FS_super_block *super_block, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t start = super_block->inode[i].start_block;
+        if (start < super_block->num_blocks)
+        {
+            super_block->free_block_list.set(start, start + super_block->inode[i].used_size);
+        }
+    }
 }
 
-// Check 2
-// Fail: 0, Success: 1
-int check2(Super_block *super_block)
+int ccheck(FS_super_block *super_block, vector<FS_violation> *violations)
 {
-    // inode names must be unique within their respective directory
-    // map<file_name, inodeID>
-    map<string, vector<int>> file_names;
+    BlockBitmap &free_list = super_block->free_block_list;
+    uint64_t blocks = super_block->num_blocks;
+    uint32_t inodes = super_block->num_inodes;
+    int lowest = 0;
+
+    // (name, parent) of the inodes in use, a table twice their number at most
+    NameSlot stackSlots[STACK_SLOTS];
+    vector<NameSlot> heapSlots;
+    size_t capacity = 256;
+    while (capacity < 2 * (size_t)inodes)
+    {
+        capacity *= 2;
+    }
+    NameSlot *slots = stackSlots;
+    if (capacity > STACK_SLOTS)
+    {
+        heapSlots.resize(capacity);
+        slots = heapSlots.data();
+    }
+    else
+    {
+        memset(stackSlots, 0, capacity * sizeof(NameSlot));
+    }
 
-    // Check all 126 Inodes
-    for (int i = 0; i < 126; i++)
+    // Rule 1 takes the extent of every inode out of the free-space list when all its blocks
+    // are in use there: a block of two extents, or one marked free, is then a clear bit, and
+    // a block still in use past the superblock at the end belongs to no file. The extents
+    // are put back before returning; on the first failure right away, so the later checks
+    // of a collecting run see the list as it is.
+    bool owning = free_list.nextClear(0) >= super_block->data_start;
+    if (!owning)
+    {
+        report(1, FS_NO_INODE, lowest, violations);
+    }
+    uint32_t owned = 0; // Inodes whose extent is out of the list
+
+    for (uint32_t i = 0; i < inodes && !(lowest == 1 && violations == nullptr); i++)
     {
-        // Test last bit of used_size
-        // If last bit = 1, inode in use
-        if (bitset<8>(super_block->inode[i].used_size).test(7))
+        const FS_inode &inode = super_block->inode[i];
+
+        // 1. Every block of a file is in use and belongs to one file, unused inodes included
+        uint64_t start = inode.start_block;
+        if (start < blocks)
         {
-            string name(super_block->inode[i].name, 5);
-            // Check if name exists
-            if (file_names.count(name) > 0)
+            uint64_t end = start + inode.used_size;
+            if (end > blocks || free_list.nextClear(start) < end)
             {
-                vector<int>::iterator it = file_names[name.c_str()].begin();
-                for (; it != file_names[name.c_str()].end(); it++)
+                report(1, i, lowest, violations);
+                if (owning)
                 {
-                    // Check if dir_parent matches another
-                    if (i != *it && bitset<7>(super_block->inode[i].dir_parent) == bitset<7>(super_block->inode[*it].dir_parent))
-                    {
-                        return 0;
-                    }
-                    file_names[name].push_back(i);
+                    restoreExtents(super_block, owned);
+                    owning = false;
                 }
             }
-            else
+            else if (owning)
             {
-                file_names.insert(pair<string, vector<int>>(name, {i}));
+                free_list.clear(start, end);
+                owned = i + 1;
             }
         }
-    }
-    return 1;
-}
 
-// Check 3
-// Fail: 0, Success: 1
-int check3(Super_block *super_block)
-{
-    // Check Inode's state, if free (0) all bits must be 0
-    // Check all 126 Inodes
-    for (size_t i = 0; i < 126; i++)
-    {
-        // Test last bit of used_size, inode's state
-        // if not free, check name exists
-        if (bitset<8>(super_block->inode[i].used_size).test(7))
+        if (inode.used)
         {
-            // Name attribute must have at least one bit
-            string nameCheck = super_block->inode[i].name;
-            if (nameCheck.empty())
+            // 2. Names are unique in each directory
+            if (!insertName(slots, capacity - 1, packName(inode.name), inode.dir_parent))
             {
-                return 0;
+                report(2, i, lowest, violations);
             }
-        }
-        else
-        {
-            // Name check
-            for (size_t j = 0; j < 5; j++)
+
+            // 3. The name of an inode in use has a bit set
+            if (inode.name[0] == '\0')
             {
-                if (bitset<8>(super_block->inode[i].name[j]).any())
-                {
-                    return 0;
-                }
+                report(3, i, lowest, violations);
+            }
+
+            // 4. A file starts in the data blocks, 5. a directory has no size and no start block
+            if (!inode.dir && (start < super_block->data_start || start >= blocks))
+            {
+                report(4, i, lowest, violations);
+            }
+            if (inode.dir && (inode.used_size != 0 || start != 0))
+            {
+                report(5, i, lowest, violations);
             }
 
-            // if free, everything in inode must be 0
-            if (super_block->inode[i].used_size == 0 && super_block->inode[i].dir_parent == 0 && super_block->inode[i].start_block == 0)
+            // 6. The parent is the root or a directory in use
+            uint32_t parent = inode.dir_parent;
+            if (parent != super_block->root &&
+                (parent >= inodes || !super_block->inode[parent].used || !super_block->inode[parent].dir))
             {
-                continue;
+                report(6, i, lowest, violations);
             }
-            return 0;
+        }
+        else if (memcmp(inode.name, "\0\0\0\0\0", 5) != 0 || inode.dir || inode.used_size != 0 || inode.dir_parent != 0 ||
+                 start != 0)
+        {
+            // 3. Every bit of a free inode is 0
+            report(3, i, lowest, violations);
         }
     }
-    return 1;
+
+    if (owning)
+    {
+        if (free_list.nextSet(super_block->data_start) < blocks)
+        {
+            report(1, FS_NO_INODE, lowest, violations);
+        }
+        restoreExtents(super_block, owned);
+    }
+    return lowest;
 }
 
-// Check 4
-// Fail: 0, Success: 1
-int check4(Super_block *super_block)
+void deserializeSB(char *block, Super_block *super_block)
 {
-    // Check Inode's start block, must be 1 to 127 (inclusive)
+    char *b = (char *)block;
+
+    // deserialize free_block_list
+    for (int i = 0; i < 16; i++)
+    {
+        super_block->free_block_list[i] = *b;
+        b++;
+    }
 
-    // Check all 126 Inodes
-    for (size_t i = 0; i < 126; i++)
+    // deserialize 126 Inodes
+    for (int i = 0; i < 126; i++)
     {
-        // Check inode's state (used_size), 1 in use
-        // Check inode's type (dir_parent), 0 for file
-        if (bitset<8>(super_block->inode[i].used_size).test(7) && !bitset<8>(super_block->inode[i].dir_parent).test(7))
+        for (int j = 0; j < 5; j++)
         {
-            // if inode's start_block <= 0 or >= 128, return 0 for fail
-            if (super_block->inode[i].start_block <= 0 || super_block->inode[i].start_block >= 128)
-            {
-                return 0;
-            }
+            super_block->inode[i].name[j] = *b;
+            b++;
         }
+        super_block->inode[i].used_size = (uint8_t)*b;
+        b++;
+        super_block->inode[i].start_block = (uint8_t)*b;
+        b++;
+        super_block->inode[i].dir_parent = (uint8_t)*b;
+        b++;
     }
-    return 1;
 }
 
-// Check 5
-// Fail: 0, Success: 1
-int check5(Super_block *super_block)
+void loadSB(Super_block *super_block, FS_super_block *fs_super_block)
 {
-    // Check Inode's size and start_block, must be 0 for directory
+    // v1 layout: 128 blocks, 126 inodes, parent 127 is root
+    fs_super_block->version = 1;
+    fs_super_block->num_blocks = 128;
+    fs_super_block->num_inodes = 126;
+    fs_super_block->data_start = 1;
+    fs_super_block->root = 127;
+    fs_super_block->max_size = 127;
+    memset(&fs_super_block->header, 0, sizeof(Super_block_v2));
+
+    fs_super_block->free_block_list.load(super_block->free_block_list, 128);
+    fs_super_block->dirty_map.reset(16);
+    fs_super_block->dirty_inodes.reset(126);
+    fs_super_block->dirty_header = false;
+
+    // No room on a v1 disk, an incremental defragmentation only lasts while it is mounted
+    fs_super_block->defrag_blocks = 0;
+    fs_super_block->defrag_files = 0;
+
+    fs_super_block->inode.resize(126);
+    for (int i = 0; i < 126; i++)
+    {
+        Inode &inode = super_block->inode[i];
+        FS_inode &fs_inode = fs_super_block->inode[i];
+
+        memcpy(fs_inode.name, inode.name, 5);
+        // [state] [size: 7 bits]
+        fs_inode.used = bitset<8>(inode.used_size).test(7);
+        fs_inode.used_size = bitset<7>(inode.used_size).to_ulong();
+        fs_inode.start_block = inode.start_block;
+        // [mode] [parent: 7 bits]
+        fs_inode.dir = bitset<8>(inode.dir_parent).test(7);
+        fs_inode.dir_parent = bitset<7>(inode.dir_parent).to_ulong();
+    }
+}
 
-    // Check all 126 Inodes
-    for (size_t i = 0; i < 126; i++)
+void serializeInodeV1(const FS_inode *inode, char *bytes)
+{
+    // 5 characters for inode's name
+    memcpy(bytes, inode->name, 5);
+    // used_size
+    bytes[5] = (char)((inode->used ? 0x80 : 0) | (inode->used_size & 0x7F));
+    // start_block
+    bytes[6] = (char)inode->start_block;
+    // dir_parent
+    bytes[7] = (char)((inode->dir ? 0x80 : 0) | (inode->dir_parent & 0x7F));
+}
+
+void serializeSB(FS_super_block *fs_super_block, char *block)
+{
+    fs_super_block->free_block_list.store(block);
+
+    // 126 Inodes
+    for (int i = 0; i < 126; i++)
     {
-        // Check inode's state (used_size), 1 in use
-        // Check Inode's type, 1 for directory
-        if (bitset<8>(super_block->inode[i].used_size).test(7) && bitset<8>(super_block->inode[i].dir_parent).test(7))
-        {
-            // Inode's size == 1000 0000 and start_block = 0
-            if (super_block->inode[i].used_size != 128 || super_block->inode[i].start_block != 0)
-            {
-                return 0;
-            }
-        }
+        serializeInodeV1(&fs_super_block->inode[i], block + 16 + 8 * i);
     }
-    return 1;
 }
 
-// Check 6
-// Fail: 0, Success: 1
-int check6(Super_block *super_block)
+// Little-endian helpers for the v2 format
+static uint32_t getU32(const char *b)
 {
-    // Check all 126 Inodes
-    for (size_t i = 0; i < 126; i++)
+    const unsigned char *u = (const unsigned char *)b;
+    return (uint32_t)u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static uint64_t getU64(const char *b)
+{
+    return (uint64_t)getU32(b) | (uint64_t)getU32(b + 4) << 32;
+}
+
+static void putU32(char *b, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
     {
-        if (bitset<8>(super_block->inode[i].used_size).test(7))
-        {
+        b[i] = (char)(value >> (8 * i));
+    }
+}
 
-            // Parent directory cannot be 126
-            if (super_block->inode[i].dir_parent == 126)
-            {
-                return 0;
-            }
+static void putU64(char *b, uint64_t value)
+{
+    putU32(b, (uint32_t)value);
+    putU32(b + 4, (uint32_t)(value >> 32));
+}
 
-            int parentInode = bitset<7>(super_block->inode[i].dir_parent).to_ulong();
-            // Check last bit of dir_parent
-            // Ignore root
-            if (parentInode != 127)
-            {
-                if (!bitset<8>(super_block->inode[parentInode].used_size).test(7) || !bitset<8>(super_block->inode[parentInode].dir_parent).test(7))
-                {
-                    return 0;
-                }
-            }
-        }
+bool deserializeHeaderV2(char *block, Super_block_v2 *header)
+{
+    memcpy(header->magic, block, 4);
+    header->version = getU32(block + 4);
+    header->block_size = getU32(block + 8);
+    header->num_blocks = getU32(block + 12);
+    header->num_inodes = getU32(block + 16);
+    header->bitmap_start = getU32(block + 20);
+    header->bitmap_blocks = getU32(block + 24);
+    header->inode_start = getU32(block + 28);
+    header->inode_blocks = getU32(block + 32);
+    header->data_start = getU32(block + 36);
+    header->defrag_blocks = getU32(block + 40);
+    header->defrag_files = getU32(block + 44);
+
+    if (memcmp(header->magic, FS_V2_MAGIC, 4) != 0 || header->version != 2 || header->block_size != 1024)
+    {
+        return false;
+    }
+
+    // Block numbers are kept as ints in memory
+    if (header->num_blocks > 0x7FFFFFFF || header->num_inodes == 0 || header->num_inodes >= FS_V2_ROOT)
+    {
+        return false;
+    }
+
+    // Regions must be in order: header, bitmap, inode table, data
+    uint64_t bitmap_end = (uint64_t)header->bitmap_start + header->bitmap_blocks;
+    uint64_t inode_end = (uint64_t)header->inode_start + header->inode_blocks;
+    if (header->bitmap_start < 1 || header->inode_start < bitmap_end || header->data_start < inode_end || header->data_start >= header->num_blocks)
+    {
+        return false;
+    }
+
+    // Regions must be large enough
+    if ((uint64_t)header->bitmap_blocks * 1024 * 8 < header->num_blocks)
+    {
+        return false;
+    }
+    if ((uint64_t)header->inode_blocks * 1024 < (uint64_t)header->num_inodes * FS_V2_INODE_SIZE)
+    {
+        return false;
     }
-    return 1;
+    return true;
+}
+
+void serializeHeaderV2(Super_block_v2 *header, char *block)
+{
+    memset(block, 0, 1024);
+    memcpy(block, header->magic, 4);
+    putU32(block + 4, header->version);
+    putU32(block + 8, header->block_size);
+    putU32(block + 12, header->num_blocks);
+    putU32(block + 16, header->num_inodes);
+    putU32(block + 20, header->bitmap_start);
+    putU32(block + 24, header->bitmap_blocks);
+    putU32(block + 28, header->inode_start);
+    putU32(block + 32, header->inode_blocks);
+    putU32(block + 36, header->data_start);
+    putU32(block + 40, header->defrag_blocks);
+    putU32(block + 44, header->defrag_files);
+}
+
+void deserializeInodeV2(const char *bytes, FS_inode *inode)
+{
+    memcpy(inode->name, bytes, 5);
+    // [state] [mode] [reserved: 6 bits]
+    inode->used = bitset<8>(bytes[5]).test(7);
+    inode->dir = bitset<8>(bytes[5]).test(6);
+    inode->dir_parent = getU32(bytes + 8);
+    inode->used_size = getU32(bytes + 12);
+
+    // Start blocks past 32 bits can never be on the disk, keep them out of range
+    uint64_t start = getU64(bytes + 16);
+    inode->start_block = start > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)start;
+}
+
+void serializeInodeV2(const FS_inode *inode, char *bytes)
+{
+    memset(bytes, 0, FS_V2_INODE_SIZE);
+    memcpy(bytes, inode->name, 5);
+    bytes[5] = (char)((inode->used ? 0x80 : 0) | (inode->dir ? 0x40 : 0));
+    putU32(bytes + 8, inode->dir_parent);
+    putU32(bytes + 12, inode->used_size);
+    putU64(bytes + 16, inode->start_block);
 }
 
-int ccheck(Super_block *super_block)
+bool readSB_v2(Disk *disk, Super_block_v2 *header, FS_super_block *fs_super_block)
 {
-    // Consistency Checking
-    // Returns smallest error code
-    if (check1(super_block) == 0)
+    fs_super_block->version = 2;
+    fs_super_block->num_blocks = header->num_blocks;
+    fs_super_block->num_inodes = header->num_inodes;
+    fs_super_block->data_start = header->data_start;
+    fs_super_block->root = FS_V2_ROOT;
+    fs_super_block->max_size = header->num_blocks - header->data_start;
+    fs_super_block->header = *header;
+
+    // Free-space bitmap region
+    vector<char> bitmap((header->num_blocks + 7) / 8);
+    if (!disk->read((off_t)header->bitmap_start * 1024, bitmap.data(), bitmap.size()))
     {
-        return 1;
+        return false;
     }
+    fs_super_block->free_block_list.load(bitmap.data(), header->num_blocks);
+    fs_super_block->dirty_map.reset(bitmap.size());
+    fs_super_block->dirty_inodes.reset(header->num_inodes);
+    fs_super_block->dirty_header = false;
+    fs_super_block->defrag_blocks = header->defrag_blocks;
+    fs_super_block->defrag_files = header->defrag_files;
+
+    // Inode table
+    vector<char> table((size_t)header->num_inodes * FS_V2_INODE_SIZE);
+    if (!disk->read((off_t)header->inode_start * 1024, table.data(), table.size()))
+    {
+        return false;
+    }
+    fs_super_block->inode.resize(header->num_inodes);
+    for (uint32_t i = 0; i < header->num_inodes; i++)
+    {
+        deserializeInodeV2(&table[(size_t)i * FS_V2_INODE_SIZE], &fs_super_block->inode[i]);
+    }
+    return true;
+}
 
-    if (check2(super_block) == 0)
+bool readSB(const char *path, FS_super_block *fs_super_block)
+{
+    int FD = open(path, O_RDONLY);
+    if (FD < 0)
+    {
+        return false;
+    }
+    FileDisk disk(FD);
+    char block[1024];
+    bool loaded = pread(FD, block, 1024, 0) == 1024;
+    if (loaded && memcmp(block, FS_V2_MAGIC, 4) == 0)
     {
-        return 2;
+        Super_block_v2 header;
+        loaded = deserializeHeaderV2(block, &header) && readSB_v2(&disk, &header, fs_super_block);
     }
+    else if (loaded)
+    {
+        Super_block v1_super_block;
+        deserializeSB(block, &v1_super_block);
+        loadSB(&v1_super_block, fs_super_block);
+    }
+    return loaded;
+}
 
-    if (check3(super_block) == 0)
+bool formatV2(int FD, uint32_t num_blocks, uint32_t num_inodes)
+{
+    Super_block_v2 header;
+    memcpy(header.magic, FS_V2_MAGIC, 4);
+    header.version = 2;
+    header.block_size = 1024;
+    header.num_blocks = num_blocks;
+    header.num_inodes = num_inodes;
+    header.bitmap_start = 1;
+    header.bitmap_blocks = (uint32_t)(((uint64_t)num_blocks + 8 * 1024 - 1) / (8 * 1024));
+    header.inode_start = header.bitmap_start + header.bitmap_blocks;
+    header.inode_blocks = (uint32_t)(((uint64_t)num_inodes * FS_V2_INODE_SIZE + 1023) / 1024);
+    header.data_start = header.inode_start + header.inode_blocks;
+    header.defrag_blocks = 0;
+    header.defrag_files = 0;
+
+    char block[1024];
+    serializeHeaderV2(&header, block);
+    if (!deserializeHeaderV2(block, &header))
     {
-        return 3;
+        return false;
     }
 
-    if (check4(super_block) == 0)
+    // Start from an all zero disk, the inode table is empty
+    if (ftruncate(FD, 0) < 0 || ftruncate(FD, (off_t)num_blocks * 1024) < 0)
+    {
+        return false;
+    }
+    if (pwrite(FD, block, 1024, 0) != 1024)
     {
-        return 4;
+        return false;
     }
 
-    if (check5(super_block) == 0)
+    // Superblock regions are in use
+    BlockBitmap free_block_list(num_blocks);
+    free_block_list.set(0, header.data_start);
+    vector<char> bitmap((num_blocks + 7) / 8);
+    free_block_list.store(bitmap.data());
+    if (pwrite(FD, bitmap.data(), bitmap.size(), (off_t)header.bitmap_start * 1024) != (ssize_t)bitmap.size())
     {
-        return 5;
+        return false;
     }
+    return true;
+}
 
-    if (check6(super_block) == 0)
+void markInode(FS_super_block *super_block, uint32_t inode)
+{
+    super_block->dirty_inodes.set(inode, inode + 1);
+}
+
+void markBlocks(FS_super_block *super_block, uint32_t start, uint32_t end)
+{
+    if (start < end)
     {
-        return 6;
+        super_block->dirty_map.set(start / 8, (end + 7) / 8);
     }
+}
+
+// Changed ranges at most this many bytes apart are written together,
+// the unchanged bytes in between included
+static const off_t WRITEBACK_GAP = 512;
 
-    // Success
-    return 0;
+// Byte offsets of the superblock regions on disk
+typedef struct {
+    off_t map;         // Free-space list
+    size_t map_bytes;
+    off_t inodes;      // Inode table
+    size_t inode_size;
+} SB_layout;
+
+static SB_layout layoutOf(FS_super_block *super_block)
+{
+    SB_layout layout;
+    layout.map_bytes = (super_block->num_blocks + 7) / 8;
+    if (super_block->version == 1)
+    {
+        layout.map = 0;
+        layout.inodes = 16;
+        layout.inode_size = 8;
+    }
+    else
+    {
+        layout.map = (off_t)super_block->header.bitmap_start * 1024;
+        layout.inodes = (off_t)super_block->header.inode_start * 1024;
+        layout.inode_size = FS_V2_INODE_SIZE;
+    }
+    return layout;
 }
 
-void deserializeSB(char *block, Super_block *super_block)
+// Appends [offset, offset + length) to ranges, merged with the last range if it is close
+static void addRange(vector<pair<off_t, size_t>> &ranges, off_t offset, size_t length)
 {
-    char *b = (char *)block;
+    if (!ranges.empty())
+    {
+        pair<off_t, size_t> &last = ranges.back();
+        if (offset - (last.first + (off_t)last.second) <= WRITEBACK_GAP)
+        {
+            last.second = (size_t)(offset + (off_t)length - last.first);
+            return;
+        }
+    }
+    ranges.push_back(make_pair(offset, length));
+}
 
-    // deserialize free_block_list
-    for (int i = 0; i < 16; i++)
+// Serializes the superblock bytes [offset, offset + length), which cover whole inodes
+static void serializeRange(FS_super_block *super_block, const SB_layout &layout, off_t offset, size_t length, char *bytes)
+{
+    off_t end = offset + (off_t)length;
+
+    // Free-space list
+    off_t lo = max(offset, layout.map);
+    off_t hi = min(end, layout.map + (off_t)layout.map_bytes);
+    if (lo < hi)
     {
-        super_block->free_block_list[i] = *b;
-        b++;
+        super_block->free_block_list.store(bytes + (lo - offset), (size_t)(lo - layout.map), (size_t)(hi - lo));
     }
 
-    // deserialize 126 Inodes
-    for (int i = 0; i < 126; i++)
+    // Inode table
+    lo = max(offset, layout.inodes);
+    hi = min(end, layout.inodes + (off_t)(layout.inode_size * super_block->num_inodes));
+    for (off_t at = lo; at < hi; at += layout.inode_size)
     {
-        for (int j = 0; j < 5; j++)
+        const FS_inode *inode = &super_block->inode[(at - layout.inodes) / layout.inode_size];
+        if (super_block->version == 1)
         {
-            super_block->inode[i].name[j] = *b;
-            b++;
+            serializeInodeV1(inode, bytes + (at - offset));
+        }
+        else
+        {
+            serializeInodeV2(inode, bytes + (at - offset));
         }
-        super_block->inode[i].used_size = (uint8_t)*b;
-        b++;
-        super_block->inode[i].start_block = (uint8_t)*b;
-        b++;
-        super_block->inode[i].dir_parent = (uint8_t)*b;
-        b++;
     }
 }
 
-map<string, vector<int>> buildFS(Super_block *super_block)
+int writebackSB(Disk *disk, FS_super_block *super_block)
 {
-    string root_dir = "root/";
-    map<string, vector<int>> tree;
+    SB_layout layout = layoutOf(super_block);
 
-    // init tree
-    tree.insert(pair<string, vector<int>>("root/", {}));
+    // Changed free-space list bytes
+    vector<pair<off_t, size_t>> ranges;
+    BlockBitmap &map = super_block->dirty_map;
+    for (size_t first = map.nextSet(0); first < map.size(); first = map.nextSet(first))
+    {
+        size_t last = map.nextClear(first);
+        addRange(ranges, layout.map + (off_t)first, last - first);
+        first = last;
+    }
 
-    for (int i = 0; i < 126; i++)
+    // Changed inodes, merged with the free-space list only if the regions touch
+    // since the padding between them is not part of the superblock
+    vector<pair<off_t, size_t>> inodes;
+    BlockBitmap &table = super_block->dirty_inodes;
+    for (size_t first = table.nextSet(0); first < table.size(); first = table.nextSet(first))
     {
-        // Check Inode's state ([0]000 0000)
-        if (bitset<8>(super_block->inode[i].used_size).test(7))
+        size_t last = table.nextClear(first);
+        addRange(inodes, layout.inodes + (off_t)(first * layout.inode_size), (last - first) * layout.inode_size);
+        first = last;
+    }
+    for (size_t i = 0; i < inodes.size(); i++)
+    {
+        if (i == 0 && layout.map + (off_t)layout.map_bytes == layout.inodes)
         {
-            // Build file/directory's directory
-            // Get parent directories until root
-            // LIFO
-            list<string> path;
-            int current_inode = i;
-            for (;;)
-            {
-                if (bitset<7>(super_block->inode[current_inode].dir_parent).all())
-                {
-                    path.push_back("root/");
-                    break;
-                }
-                path.push_back(super_block->inode[current_inode].name);
-                current_inode = (int)bitset<7>(super_block->inode[i].dir_parent).to_ulong();
-            }
+            addRange(ranges, inodes[i].first, inodes[i].second);
+        }
+        else
+        {
+            ranges.push_back(inodes[i]);
+        }
+    }
 
-            string directory;
-            while (!path.empty())
-            {
-                directory += path.front();
-                path.pop_front();
-            }
+    // v2 header, it only changes with the incremental defragmentation state
+    int writes = 0;
+    if (super_block->version == 2 && super_block->dirty_header)
+    {
+        char block[1024];
+        super_block->header.defrag_blocks = super_block->defrag_blocks;
+        super_block->header.defrag_files = super_block->defrag_files;
+        serializeHeaderV2(&super_block->header, block);
+        if (!disk->write(0, block, 1024))
+        {
+            return -1;
+        }
+        writes++;
+    }
 
-            // Check if key exists
-            int check = tree.count(directory);
-            if (check > 0)
-            {
-                tree[directory].push_back(i);
-            }
-            else
+    vector<char> bytes;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        bytes.resize(ranges[i].second);
+        serializeRange(super_block, layout, ranges[i].first, ranges[i].second, bytes.data());
+        if (!disk->write(ranges[i].first, bytes.data(), bytes.size()))
+        {
+            return -1;
+        }
+    }
+
+    map.clear(0, map.size());
+    table.clear(0, table.size());
+    super_block->dirty_header = false;
+    return writes + (int)ranges.size();
+}
+
+uint32_t planDefrag(FS_super_block *super_block, vector<FS_move> &plan)
+{
+    // Files in block order
+    vector<pair<uint32_t, int>> files;
+    for (uint32_t i = 0; i < super_block->num_inodes; i++)
+    {
+        FS_inode &inode = super_block->inode[i];
+        if (inode.used && !inode.dir && inode.used_size > 0)
+        {
+            files.push_back(make_pair(inode.start_block, (int)i));
+        }
+    }
+    sort(files.begin(), files.end());
+
+    plan.clear();
+    uint32_t next = super_block->data_start;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        FS_inode &inode = super_block->inode[files[i].second];
+        if (inode.start_block != next)
+        {
+            FS_move move;
+            move.inode = files[i].second;
+            move.from = inode.start_block;
+            move.to = next;
+            move.size = inode.used_size;
+            plan.push_back(move);
+        }
+        next += inode.used_size;
+    }
+    return next;
+}
+
+bool childLists(const FS_super_block *super_block, vector<pair<uint32_t, uint32_t>> &directories,
+                vector<uint32_t> &entries)
+{
+    // Entries per parent, the root counts in the last slot
+    uint32_t inodes = super_block->num_inodes;
+    vector<uint32_t> next(inodes + 1, 0);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < inodes; i++)
+    {
+        const FS_inode &inode = super_block->inode[i];
+        if (inode.used)
+        {
+            if (inode.dir_parent == super_block->root || inode.dir_parent < inodes)
             {
-                // Add new directory key to tree and Inode ID
-                tree.insert(pair<string, vector<int>>(directory, {i}));
+                next[inode.dir_parent == super_block->root ? inodes : inode.dir_parent]++;
             }
+            used++;
+        }
+    }
+
+    // Directories in order, each count becomes the position of its first entry
+    directories.clear();
+    directories.push_back(make_pair(super_block->root, next[inodes]));
+    uint32_t position = next[inodes];
+    next[inodes] = 0;
+    for (uint32_t i = 0; i < inodes; i++)
+    {
+        uint32_t count = next[i];
+        next[i] = position;
+        if (super_block->inode[i].used && super_block->inode[i].dir)
+        {
+            directories.push_back(make_pair(i, count));
+            position += count;
+        }
+    }
+
+    // Entries in inode order, so every group stays in inode order
+    entries.resize(position);
+    bool linked = position == used;
+    for (uint32_t i = 0; i < inodes; i++)
+    {
+        const FS_inode &inode = super_block->inode[i];
+        if (!inode.used)
+        {
+            continue;
+        }
+        uint32_t parent = inode.dir_parent;
+        if (parent == super_block->root)
+        {
+            entries[next[inodes]++] = i;
+        }
+        else if (parent < inodes && super_block->inode[parent].used && super_block->inode[parent].dir)
+        {
+            entries[next[parent]++] = i;
         }
     }
-    return tree;
+    return linked;
 }
 
-void childInodes(Super_block *super_block, vector<int> &inodes, int parentInode)
+void buildFS(FS_super_block *super_block, DirIndex *tree)
 {
-    // Check all inodes
-    for (int i = 0; i < 126; i++)
+    vector<pair<uint32_t, uint32_t>> directories;
+    vector<uint32_t> entries;
+    childLists(super_block, directories, entries);
+    buildFS(super_block, directories, entries, tree);
+}
+
+void buildFS(const FS_super_block *super_block, const vector<pair<uint32_t, uint32_t>> &directories,
+             const vector<uint32_t> &entries, DirIndex *tree)
+{
+    tree->clear();
+
+    // Directories first, each sized for its entries
+    for (size_t d = 0; d < directories.size(); d++)
+    {
+        tree->addDirectory(directories[d].first, directories[d].second);
+    }
+
+    // Then one directory after the other
+    size_t e = 0;
+    for (size_t d = 0; d < directories.size(); d++)
+    {
+        for (size_t end = e + directories[d].second; e < end; e++)
+        {
+            tree->insert(directories[d].first, super_block->inode[entries[e]].name, entries[e]);
+        }
+    }
+}
+
+void childInodes(FS_super_block *super_block, DirIndex *tree, vector<int> &inodes, int parentInode)
+{
+    // Walk the subtree through the directory index
+    vector<int> directories(1, parentInode);
+    while (!directories.empty())
     {
-        // Check if inode has the right parent inode
-        if (bitset<7>(super_block->inode[i].dir_parent).to_ulong() == (ulong) parentInode)
+        int directory = directories.back();
+        directories.pop_back();
+
+        const list<int> &children = tree->children(directory);
+        for (list<int>::const_iterator it = children.begin(); it != children.end(); it++)
         {
             // Check if the that inode has childs
-            if (bitset<8>(super_block->inode[i].dir_parent).test(7))
+            if (super_block->inode[*it].dir)
             {
-                childInodes(super_block, inodes, i);
+                directories.push_back(*it);
             }
-            inodes.push_back(i);
+            inodes.push_back(*it);
         }
     }
-}
\ No newline at end of file
+}
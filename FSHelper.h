@@ -3,60 +3,177 @@
 #include <vector>
 
 #include "FileSystem.h"
+#include "BlockBitmap.h"
+#include "DirIndex.h"
+#include "Disk.h"
 
-// Consistency Checker
-int ccheck(Super_block *super_block);
+/**
+ * In-memory inode, the same for every on-disk format
+ */
+typedef struct {
+	char name[5];         // Name of the file or directory
+	bool used;            // Inode state
+	bool dir;             // Inode mode, directory when set
+	uint32_t used_size;   // Size of the file in blocks
+	uint32_t start_block; // Index of the start file block
+	uint32_t dir_parent;  // Index of the parent inode, root for the root directory
+} FS_inode;
 
 /**
- * Blocks that are marked free in the free-space list cannot be 
- * allocated to any file. Similarly, blocks marked in use in the 
- * free-space list must be allocated to exactly one file.
- */ 
-int check1(Super_block *super_block);
+ * In-memory superblock of a v1 or v2 disk
+ */
+typedef struct FS_super_block {
+	int version;                // 1 or 2
+	uint32_t num_blocks;        // Blocks on the disk, including the superblock
+	uint32_t num_inodes;        // Inodes in the inode table
+	uint32_t data_start;        // First data block
+	uint32_t root;              // dir_parent of the entries in the root directory
+	uint32_t max_size;          // Largest file size the format can store
+	Super_block_v2 header;      // v2 only, layout of the superblock regions
+	BlockBitmap free_block_list; // Free-space list
+	std::vector<FS_inode> inode;
+	uint32_t defrag_blocks;      // Incremental defragmentation budget per step, 0 when none is running
+	uint32_t defrag_files;
+	BlockBitmap dirty_inodes;    // Inodes changed since the last writeback
+	BlockBitmap dirty_map;       // Free-space list bytes changed since the last writeback
+	bool dirty_header;           // v2 header changed since the last writeback
+} FS_super_block;
+
+// Inode of a violation that is about no single inode
+#define FS_NO_INODE 0xFFFFFFFF
+
+typedef struct {
+	int code;       // Rule broken, 1 to 6
+	uint32_t inode; // Inode that breaks it, FS_NO_INODE for the free-space list as a whole
+} FS_violation;
+
+/**
+ * Consistency checker. Returns the smallest number of the rules below that the superblock
+ * breaks, 0 if it is consistent:
+ * 1. Blocks that are marked free in the free-space list cannot be allocated to any file.
+ *    Similarly, blocks marked in use in the free-space list must be allocated to exactly
+ *    one file (the superblock blocks are always in use).
+ * 2. The name of every file/directory must be unique in each directory.
+ * 3. If the state of an inode is free, all bits in this inode must be zero. Otherwise,
+ *    the name attribute stored in the inode must have at least one bit that is not zero.
+ * 4. The start block of every inode that is marked as a file must be a data block.
+ * 5. The size and start block of an inode that is marked as a directory must be zero.
+ * 6. The parent of every inode in use is the root or an inode in use marked as a directory.
+ *
+ * Every rule is checked in one pass over the inode table, with no heap allocation on a v1
+ * disk. The free-space list is changed during the check and restored before it returns.
+ * When violations is given, every violation found is added to it, in inode order, instead
+ * of stopping at the first rule 1 failure.
+ */
+int ccheck(FS_super_block *super_block, std::vector<FS_violation> *violations = nullptr);
+
+/**
+ * Super_block deserializer
+ */
+void deserializeSB(char *block, Super_block *super_block);
 
 /**
- * The name of every file/directory must be unique in each directory.
- */ 
-int check2(Super_block *super_block);
+ * Loads a v1 Super_block into the in-memory superblock
+ */
+void loadSB(Super_block *super_block, FS_super_block *fs_super_block);
 
 /**
- * If the state of an inode is free, all bits in this inode must be zero. 
- * Otherwise, the name attribute stored in the inode must have at least one bit that is not zero.
+ * Serializes the in-memory superblock of a v1 disk into a 1KB block
  */
-int check3(Super_block *super_block);
+void serializeSB(FS_super_block *fs_super_block, char *block);
 
 /**
- * The start block of every inode that is marked as a file 
- * must have a value between 1 and 127 inclusive.
- */ 
-int check4(Super_block *super_block);
+ * v1 inode serializer, 8 bytes
+ */
+void serializeInodeV1(const FS_inode *inode, char *bytes);
 
+/**
+ * Reads the v2 header from block 0. Returns false if the header does not
+ * describe a usable layout.
+ */
+bool deserializeHeaderV2(char *block, Super_block_v2 *header);
 
 /**
- * The size and start block of an inode that is 
- * marked as a directory must be zero.
- */ 
-int check5(Super_block *super_block);
+ * Serializes a v2 header into a 1KB block
+ */
+void serializeHeaderV2(Super_block_v2 *header, char *block);
 
 /**
- * For every inode, the index of its parent inode cannot be 126. 
- * Moreover, if the index of the parent inode is between 0 and 125 
- * inclusive, then the parent inode must be in use and marked 
- * as a directory.
- */ 
-int check6(Super_block *super_block);
+ * Inode table entry deserializer/serializer, FS_V2_INODE_SIZE bytes
+ */
+void deserializeInodeV2(const char *bytes, FS_inode *inode);
+void serializeInodeV2(const FS_inode *inode, char *bytes);
 
 /**
- * Super_block deserializer 
- */ 
-void deserializeSB(char *block, Super_block *super_block);
+ * Reads the bitmap region and inode table of a v2 disk into the in-memory superblock,
+ * through disk so the reads are counted like any other. Returns false if the disk cannot be read.
+ */
+bool readSB_v2(Disk *disk, Super_block_v2 *header, FS_super_block *fs_super_block);
 
 /**
- * Creates a tree for all the directories and files in the Super_block
- */ 
-std::map<std::string, std::vector<int>> buildFS(Super_block *super_block);
+ * Reads the superblock of the v1 or v2 image at path, false if it cannot be read or
+ * its v2 header does not describe a usable layout.
+ */
+bool readSB(const char *path, FS_super_block *fs_super_block);
 
 /**
- * Adds child inodes to a vector.
- */ 
-void childInodes(Super_block *super_block, std::vector<int>& inodes, int parentInode);
\ No newline at end of file
+ * Writes an empty v2 file system with the given number of blocks and inodes to FD.
+ * Returns false if the layout does not fit or the disk cannot be written.
+ */
+bool formatV2(int FD, uint32_t num_blocks, uint32_t num_inodes);
+
+/**
+ * Records that an inode, or the free-space list bits of blocks [start, end), changed
+ * and must be written by the next writebackSB
+ */
+void markInode(FS_super_block *super_block, uint32_t inode);
+void markBlocks(FS_super_block *super_block, uint32_t start, uint32_t end);
+
+/**
+ * Writes the changed inodes and free-space list bytes (and the v2 header) to disk. Changed ranges that are
+ * close together are merged, so a command usually costs a single write.
+ * Returns the number of writes, -1 if the disk cannot be written.
+ */
+int writebackSB(Disk *disk, FS_super_block *super_block);
+
+/**
+ * One file of a defragmentation plan
+ */
+typedef struct {
+	int inode;     // File to move
+	uint32_t from; // Start block before defragmentation
+	uint32_t to;   // Start block after defragmentation
+	uint32_t size; // Blocks to move
+} FS_move;
+
+/**
+ * Plans the compaction of every file towards data_start: the files that have to move,
+ * in block order, each straight to its final place. Moving them in this order never
+ * overwrites a file that has not moved yet.
+ * Returns the first free block after the compaction.
+ */
+uint32_t planDefrag(FS_super_block *super_block, std::vector<FS_move> &plan);
+
+/**
+ * Children of every directory as adjacency arrays: directories holds the root and then
+ * the directory inodes in inode order, each with its number of entries, and entries the
+ * children of all of them, grouped in the same order and each group in inode order.
+ * Three linear passes over the inode table (count, place, fill), at any depth. Returns
+ * false if an inode in use has a parent that is neither the root nor a directory in use,
+ * that inode is left out.
+ */
+bool childLists(const FS_super_block *super_block, std::vector<std::pair<uint32_t, uint32_t>> &directories,
+                std::vector<uint32_t> &entries);
+
+/**
+ * Builds the directory index for all the directories and files in the Super_block, from
+ * childLists() or from lists of the same layout
+ */
+void buildFS(FS_super_block *super_block, DirIndex *tree);
+void buildFS(const FS_super_block *super_block, const std::vector<std::pair<uint32_t, uint32_t>> &directories,
+             const std::vector<uint32_t> &entries, DirIndex *tree);
+
+/**
+ * Adds every inode below parentInode (files and directories, at any depth) to a vector.
+ */
+void childInodes(FS_super_block *super_block, DirIndex *tree, std::vector<int>& inodes, int parentInode);
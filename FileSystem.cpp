@@ -1,3 +1,4 @@
+#include <cstdarg>
 #include <cstdio>
 #include <cstdint>
 #include <cassert>
@@ -10,6 +11,7 @@
 #include <bitset>
 #include <map>
 #include <list>
+#include <mutex>
 #include <vector>
 
 #include <fcntl.h>
@@ -18,158 +20,344 @@
 
 #include "FSHelper.h"
 #include "Helper.h"
+#include "FreeExtents.h"
+#include "BufferPool.h"
+#include "RWLock.h"
+#include "Snapshot.h"
+#include "Timeline.h"
 
 using namespace std;
 
-// Global Variables
-int FILE_DESCRIPTOR = -1;     // Mounted disk
-bitset<8> CURR_DIRECTORY;     // Current working directory
-string CURR_DIRECTORY_STRING; // Current working directory in string form
-string DISK_NAME;             // Mounted disk name
-bool MOUNTED;                 // Mounted checker
+ssize_t BLOCK_SIZE = 1024; // BLOCK_SIZE
 
-Super_block *SUPER_BLOCK = nullptr; // Super_block
-char BUFFER[1024];                  // Buffer
+FileSystem::FileSystem()
+    : disk(nullptr), mapDisk(false), snapshots(false), currDirectory(0), mounted(false), batch(false),
+      deferZero(false), concurrent(false), cacheCapacity(0), out(&cout), err(&cerr), superBlock(nullptr), buffers(FS_BUFFER_SLOTS)
+{
+}
 
-map<string, vector<int>> FILE_TREE; // Pointer to a file tree
+FileSystem::~FileSystem()
+{
+    unmount();
+}
 
-ssize_t BLOCK_SIZE = 1024; // BLOCK_SIZE
+void FileSystem::setOutput(ostream &out, ostream &err)
+{
+    ShardedRWGuard dir(dirLock, true);
+    this->out = &out;
+    this->err = &err;
+}
+
+// printf to the output stream
+void FileSystem::print(const char *format, ...)
+{
+    char line[64];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    out->write(line, min(length, (int)sizeof(line) - 1));
+}
 
 // Return inode of name in the current directory
-int inodeSearch(char name[5])
+int FileSystem::inodeSearch(char name[5])
 {
     // Check if file is under the working directory
-    vector<int>::iterator it_map = FILE_TREE[CURR_DIRECTORY_STRING].begin();
-    while (it_map != FILE_TREE[CURR_DIRECTORY_STRING].end())
+    return fileTree.lookup(currDirectory, name);
+}
+
+// Remove the queued blocks in [start, end) from zeroQueue and add them to ranges
+void FileSystem::takeQueued(uint32_t start, uint32_t end, vector<pair<uint32_t, uint32_t>> &ranges)
+{
+    map<uint32_t, uint32_t>::iterator it = zeroQueue.upper_bound(start);
+    if (it != zeroQueue.begin() && prev(it)->second > start)
+    {
+        --it;
+    }
+    while (it != zeroQueue.end() && it->first < end)
     {
-        if (strncmp(SUPER_BLOCK->inode[*it_map].name, name, 5) == 0)
+        uint32_t first = it->first;
+        uint32_t last = it->second;
+        it = zeroQueue.erase(it);
+        if (first < start)
+        {
+            zeroQueue[first] = start;
+        }
+        if (last > end)
         {
-            return *it_map;
+            zeroQueue[end] = last;
         }
-        it_map++;
+        ranges.push_back(make_pair(max(first, start), min(last, end)));
     }
-    return -1;
 }
 
-// Update superblock onto disk
-void updateSB()
+// Zero data blocks [start, end) now
+void FileSystem::zeroBlocks(uint32_t start, uint32_t end)
 {
-    char buffer[1024];
-    strncpy(buffer, SUPER_BLOCK->free_block_list, 16);
-    int bufferIndex = 16;
-    // 126 Inodes
-    for (int i = 0; i < 126; i++)
+    Metrics::Site site(Metrics::SITE_ZERO);
+    if (start < end && !blockCache.zero(start, end - start))
     {
-        // 5 characters for inode's name
-        for (int j = 0; j < 5; j++)
-        {
-            buffer[bufferIndex] = SUPER_BLOCK->inode[i].name[j];
-            bufferIndex++;
-        }
-        // used_size
-        buffer[bufferIndex] = (char)SUPER_BLOCK->inode[i].used_size;
-        bufferIndex++;
-        // start_block
-        buffer[bufferIndex] = (char)SUPER_BLOCK->inode[i].start_block;
-        bufferIndex++;
-        // dir_parent
-        buffer[bufferIndex] = (char)SUPER_BLOCK->inode[i].dir_parent;
-        bufferIndex++;
+        *err << "Error: Cannot write to block." << endl;
     }
-    // Update the superblock
-    updateBlock(FILE_DESCRIPTOR, buffer, 0);
 }
 
-void fs_mount(char *new_disk_name)
+// Zero the queued blocks in [start, end) before they are used again
+void FileSystem::zeroQueued(uint32_t start, uint32_t end)
+{
+    if (zeroQueue.empty())
+    {
+        return;
+    }
+    vector<pair<uint32_t, uint32_t>> ranges;
+    takeQueued(start, end, ranges);
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        zeroBlocks(ranges[i].first, ranges[i].second);
+    }
+}
+
+// Zero every queued block
+void FileSystem::drainQueued(void)
+{
+    map<uint32_t, uint32_t> queued;
+    queued.swap(zeroQueue);
+    for (map<uint32_t, uint32_t>::iterator it = queued.begin(); it != queued.end(); ++it)
+    {
+        zeroBlocks(it->first, it->second);
+    }
+}
+
+// Zero freed data blocks [start, end), or queue them in deferred mode
+void FileSystem::reclaimBlocks(uint32_t start, uint32_t end)
+{
+    if (start >= end)
+    {
+        return;
+    }
+    if (!deferZero)
+    {
+        zeroBlocks(start, end);
+        return;
+    }
+
+    // Merge with the queued ranges it touches
+    map<uint32_t, uint32_t>::iterator it = zeroQueue.upper_bound(start);
+    if (it != zeroQueue.begin() && prev(it)->second >= start)
+    {
+        --it;
+        start = it->first;
+        end = max(end, it->second);
+        it = zeroQueue.erase(it);
+    }
+    while (it != zeroQueue.end() && it->first <= end)
+    {
+        end = max(end, it->second);
+        it = zeroQueue.erase(it);
+    }
+    zeroQueue[start] = end;
+}
+
+// Mark data blocks [start, end) as used
+void FileSystem::useBlocks(int start, int end)
+{
+    // A block is always zero when it is allocated
+    zeroQueued(start, end);
+    superBlock->free_block_list.set(start, end);
+    markBlocks(superBlock, start, end);
+    freeExtents.allocate(start, end - start);
+}
+
+// Mark data blocks [start, end) as free
+void FileSystem::freeBlocks(int start, int end)
+{
+    superBlock->free_block_list.clear(start, end);
+    markBlocks(superBlock, start, end);
+    freeExtents.release(start, end - start);
+}
+
+// Write the cached data blocks and the superblock changes
+void FileSystem::writeback(void)
+{
+    Timeline::Span span("updateSB");
+
+    // Data blocks first, the superblock must not point at blocks still in memory
+    Metrics::Site cache(Metrics::SITE_CACHE);
+    bool flushed = blockCache.flush();
+    Metrics::Site site(Metrics::SITE_SUPERBLOCK);
+    if (!flushed || writebackSB(disk, superBlock) < 0)
+    {
+        *err << "Error: Cannot write to block." << endl;
+    }
+}
+
+// Update superblock onto disk, unless a batch is open
+void FileSystem::updateSB(void)
+{
+    if (!batch)
+    {
+        writeback();
+    }
+}
+
+void FileSystem::mount(char *new_disk_name)
 {
+    Metrics::Timer timer(counters, Metrics::MOUNT);
+    ShardedRWGuard dir(dirLock, true);
+
     // Make sure there is a disk name
     assert(new_disk_name != NULL);
 
     // 1KB Buffer
     char buffer[1024];
 
-    // Bytes
-    ssize_t block;
+    // The disk may be mounted again, write what the current one still holds
+    sync();
+    saveSnapshot();
 
     // Open disk
     int FD = open(new_disk_name, O_RDWR, S_IRWXU | S_IRWXG | S_IRWXO);
     if (FD < 0)
     {
-        cerr << "Error: Cannot find disk " << new_disk_name << "." << endl;
+        *err << "Error: Cannot find disk " << new_disk_name << "." << endl;
         return;
     }
 
-    // First 1KB is SuperBlock
-    // Get first block, read 1KB from disk
-    block = pread(FD, buffer, BLOCK_SIZE, 0);
-    if (block < 0)
+    // The superblock is read through the disk, so mount counts its reads like the writeback
+    FileDisk *reader = new FileDisk(FD);
+    reader->setMetrics(&counters);
+
+    FS_super_block *super_block = new FS_super_block;
+    int ccheckVal = 0;
     {
-        cerr << "Error: Cannot read block" << endl;
-        return;
-    }
+        Metrics::Site site(Metrics::SITE_SUPERBLOCK);
 
-    Super_block *super_block = new Super_block;
-    deserializeSB(buffer, super_block);
+        // First 1KB is SuperBlock
+        // Get first block, read 1KB from disk
+        if (!reader->read(0, buffer, BLOCK_SIZE))
+        {
+            *err << "Error: Cannot read block" << endl;
+            delete super_block;
+            delete reader;
+            return;
+        }
+
+        // Detect the format
+        Super_block_v2 header;
+        if (memcmp(buffer, FS_V2_MAGIC, 4) == 0)
+        {
+            // An unusable layout cannot match the free-space list
+            if (!deserializeHeaderV2(buffer, &header) || !readSB_v2(reader, &header, super_block))
+            {
+                ccheckVal = 1;
+            }
+        }
+        else
+        {
+            Super_block v1_super_block;
+            deserializeSB(buffer, &v1_super_block);
+            loadSB(&v1_super_block, super_block);
+        }
+    }
 
-    // Consistency Check
-    int ccheckVal = ccheck(super_block);
+    // Consistency Check, unless the snapshot of the last unmount matches the superblock
+    Snapshot snapshot;
+    bool restored = false;
+    if (ccheckVal == 0 && snapshots)
+    {
+        Timeline::Span span("snapshot load");
+        restored = snapshot.load(Snapshot::path(new_disk_name).c_str(), super_block, FD);
+    }
+    if (ccheckVal == 0 && !restored)
+    {
+        Timeline::Span span("ccheck");
+        ccheckVal = ccheck(super_block);
+    }
     if (ccheckVal > 0)
     {
-        cerr << "Error: File system in " << new_disk_name << " is inconsistent (error code: " << ccheckVal << ")" << endl;
+        *err << "Error: File system in " << new_disk_name << " is inconsistent (error code: " << ccheckVal << ")" << endl;
 
         delete super_block;
+        delete reader;
 
         // Mount previous FS
     }
     else
     {
-        FILE_DESCRIPTOR = FD;
+        // pread/pwrite unless mapping was asked for and works
+        Disk *opened = reader;
+        if (mapDisk)
+        {
+            MappedDisk *mapped = MappedDisk::map(FD, (size_t)super_block->num_blocks * BLOCK_SIZE);
+            if (mapped != nullptr)
+            {
+                reader->release();
+                delete reader;
+                opened = mapped;
+                opened->setMetrics(&counters);
+            }
+        }
+        blockCache.attach(opened);
+        delete disk;
+        disk = opened;
 
-        if (SUPER_BLOCK != nullptr)
+        if (superBlock != nullptr)
         {
-            delete SUPER_BLOCK;
+            delete superBlock;
         }
 
-        SUPER_BLOCK = super_block;
-        DISK_NAME = new_disk_name;
+        superBlock = super_block;
+        diskName = new_disk_name;
+        if (restored)
+        {
+            Timeline::Span span("snapshot apply");
+            snapshot.apply(superBlock, &fileTree, &freeExtents);
+        }
+        else
+        {
+            freeExtents.build(superBlock->free_block_list, superBlock->data_start);
 
-        // Build File Tree
-        // FS Tree
-        FILE_TREE = buildFS(SUPER_BLOCK);
-        MOUNTED = true;
+            // Build File Tree
+            // FS Tree
+            Timeline::Span span("buildFS");
+            buildFS(superBlock, &fileTree);
+        }
+        mounted = true;
     }
 
     // Current work directory should be root/
-    // Set all bits to 1, CURR_DIRECTORY = 111 1111
-    CURR_DIRECTORY.set();
-    CURR_DIRECTORY.set(7, 0);
-    CURR_DIRECTORY_STRING = "root/";
+    if (superBlock != nullptr)
+    {
+        currDirectory = superBlock->root;
+    }
 
     // Mounted!
 }
 
-void fs_create(char name[5], int size)
+void FileSystem::create(char name[5], int size)
 {
-    if (!MOUNTED)
+    Metrics::Timer timer(counters, Metrics::CREATE);
+    ShardedRWGuard dir(dirLock, true);
+
+    if (!mounted)
     {
-        cerr << "Error: No file system is mounted" << endl;
+        *err << "Error: No file system is mounted" << endl;
         return;
     }
 
     // Check if name is illegal
     if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
     {
-        cerr << "File or directory " << name << " already exists" << endl;
+        *err << "File or directory " << name << " already exists" << endl;
         return;
     }
 
-    // Check name in CURR_DIRECTORY_STRING
+    // Check name in currDirectory
     int inodeID = inodeSearch(name);
     if (inodeID >= 0)
     {
         // Matched
-        cerr << "File or directory ";
-        cerr.write(name, 5) << " already exists" << endl;
+        *err << "File or directory ";
+        err->write(name, 5) << " already exists" << endl;
         return;
     }
 
@@ -178,22 +366,22 @@ void fs_create(char name[5], int size)
     if (size > 0)
     {
         // Find contiguous blocks from data blocks
-        // We get the most suitable fit for file
-        starting_block = empty_block_finder(contigous_count(SUPER_BLOCK->free_block_list), size);
+        // First fit, scanning from block 1
+        starting_block = freeExtents.firstFit(size);
         if (starting_block < 0)
         {
-            cerr << "Error: Cannot allocate " << size << " on " << DISK_NAME << endl;
+            *err << "Error: Cannot allocate " << size << " on " << diskName << endl;
             return;
         }
     }
 
     // Get empty inode
     inodeID = 0;
-    bool found_inode;
+    bool found_inode = false;
     // Check all inodes
-    for (size_t i = 0; i < 126; i++)
+    for (size_t i = 0; i < superBlock->num_inodes; i++)
     {
-        if (!bitset<8>(SUPER_BLOCK->inode[i].used_size).test(7))
+        if (!superBlock->inode[i].used)
         {
             inodeID = i;
             found_inode = true;
@@ -203,47 +391,47 @@ void fs_create(char name[5], int size)
 
     if (!found_inode)
     {
-        cerr << "Error: Superblock in disk " << DISK_NAME << " is full, cannot create " << name << endl;
+        *err << "Error: Superblock in disk " << diskName << " is full, cannot create " << name << endl;
         return;
     }
 
-    // Assign values to inode
-    strncpy(SUPER_BLOCK->inode[inodeID].name, name, 5);
-    SUPER_BLOCK->inode[inodeID].used_size = (uint8_t)bitset<8>(bitset<8>(size) | bitset<8>("10000000")).to_ulong();
-    SUPER_BLOCK->inode[inodeID].start_block = (uint8_t)starting_block;
+    // Assign values to inode, the name is padded with NULs and has no terminator at 5 bytes
+    memset(superBlock->inode[inodeID].name, 0, 5);
+    memcpy(superBlock->inode[inodeID].name, name, strnlen(name, 5));
+    superBlock->inode[inodeID].used = true;
+    superBlock->inode[inodeID].used_size = size;
+    superBlock->inode[inodeID].start_block = starting_block;
 
-    bitset<8> dir_parent(0);
     // File: size > 0, Directory: size = 0
-    if (size == 0)
-    {
-        dir_parent.set(7, 1);
-    }
+    superBlock->inode[inodeID].dir = (size == 0);
     // Get curr_diretory inode
-    dir_parent |= CURR_DIRECTORY;
+    superBlock->inode[inodeID].dir_parent = currDirectory;
+    markInode(superBlock, inodeID);
 
-    SUPER_BLOCK->inode[inodeID].dir_parent = (uint8_t)dir_parent.to_ulong();
-
-    // Update FILE_TREE
+    // Update fileTree
     if (size == 0)
     {
         // Add a new directory with no files
-        FILE_TREE.insert(pair<string, vector<int>>(CURR_DIRECTORY_STRING + name + "/", {}));
+        fileTree.addDirectory(inodeID);
     }
     else
     {
         // Update block_list for files
-        set_block_list(SUPER_BLOCK->free_block_list, starting_block, starting_block + size, true);
+        useBlocks(starting_block, starting_block + size);
     }
 
-    FILE_TREE[CURR_DIRECTORY_STRING].push_back(inodeID);
+    fileTree.insert(currDirectory, superBlock->inode[inodeID].name, inodeID);
     updateSB();
 }
 
-void fs_delete(char name[5])
+void FileSystem::remove(char name[5])
 {
-    if (!MOUNTED)
+    Metrics::Timer timer(counters, Metrics::DELETE);
+    ShardedRWGuard dir(dirLock, true);
+
+    if (!mounted)
     {
-        cerr << "Error: No file system is mounted" << endl;
+        *err << "Error: No file system is mounted" << endl;
         return;
     }
 
@@ -251,8 +439,8 @@ void fs_delete(char name[5])
     int inodeID = inodeSearch(name);
     if (inodeID < 0)
     {
-        cerr << "Error: File or directory ";
-        cerr.write(name, 5) << " does not exist" << endl;
+        *err << "Error: File or directory ";
+        err->write(name, 5) << " does not exist" << endl;
         return;
     }
 
@@ -261,21 +449,11 @@ void fs_delete(char name[5])
     vector<int> inodeList;
     // Find child inodes for directory
     // Directory = 1, File = 0
-    if (bitset<8>(SUPER_BLOCK->inode[inodeID].dir_parent).test(7))
+    if (superBlock->inode[inodeID].dir)
     {
         // Directory
-        childInodes(SUPER_BLOCK, inodeList, inodeID);
+        childInodes(superBlock, &fileTree, inodeList, inodeID);
         inodeList.push_back(inodeID);
-        // Remove directory and childs from FILE_TREE
-        map<string, vector<int>>::iterator it = FILE_TREE.begin();
-        string directory = CURR_DIRECTORY_STRING + string(SUPER_BLOCK->inode[inodeID].name, 5).c_str() + "/";
-        for (; it != FILE_TREE.end(); it++)
-        {
-            if (directory.compare(0, directory.size(), it->first) == 0)
-            {
-                FILE_TREE.erase(it);
-            }
-        }
     }
     else
     {
@@ -283,265 +461,348 @@ void fs_delete(char name[5])
         inodeList.push_back(inodeID);
     }
 
-    // Remove file/directory from FILE_TREE
-    vector<int>::iterator it = find(FILE_TREE[CURR_DIRECTORY_STRING].begin(), FILE_TREE[CURR_DIRECTORY_STRING].end(), inodeID);
-    if (it != FILE_TREE[CURR_DIRECTORY_STRING].end())
-    {
-        FILE_TREE[CURR_DIRECTORY_STRING].erase(it);
-    }
+    // Remove file/directory from fileTree, directories below it go with their inodes
+    fileTree.erase(currDirectory, superBlock->inode[inodeID].name, inodeID);
+
+    // Data blocks of the deleted files, neighbouring extents are zeroed together
+    vector<pair<uint32_t, uint32_t>> extents;
 
     while (!inodeList.empty())
     {
         int inode = inodeList.back();
         inodeList.pop_back();
 
-        int start = SUPER_BLOCK->inode[inode].start_block;
-        int end = start + bitset<7>(SUPER_BLOCK->inode[inode].used_size).to_ulong();
-
-        // Zero out data blocks
-        for (int i = start; i < end; i++)
+        int start = superBlock->inode[inode].start_block;
+        int end = start + superBlock->inode[inode].used_size;
+        if (start < end)
         {
-            char emptyBlock[1024];
-            memset(emptyBlock, 0, 1024);
-            updateBlock(FILE_DESCRIPTOR, emptyBlock, i * BLOCK_SIZE);
+            extents.push_back(make_pair(start, end));
         }
 
         // Update free_block_list
-        set_block_list(SUPER_BLOCK->free_block_list, start, end, false);
+        freeBlocks(start, end);
+
+        if (superBlock->inode[inode].dir)
+        {
+            fileTree.removeDirectory(inode);
+        }
 
         // Zero out Inodes
-        strncpy(SUPER_BLOCK->inode[inode].name, "", 5);
-        SUPER_BLOCK->inode[inode].used_size = 0;
-        SUPER_BLOCK->inode[inode].start_block = 0;
-        SUPER_BLOCK->inode[inode].dir_parent = 0;
+        strncpy(superBlock->inode[inode].name, "", 5);
+        superBlock->inode[inode].used = false;
+        superBlock->inode[inode].dir = false;
+        superBlock->inode[inode].used_size = 0;
+        superBlock->inode[inode].start_block = 0;
+        superBlock->inode[inode].dir_parent = 0;
+        markInode(superBlock, inode);
+    }
+
+    // Zero out data blocks
+    sort(extents.begin(), extents.end());
+    size_t first = 0;
+    while (first < extents.size())
+    {
+        uint32_t end = extents[first].second;
+        size_t last = first + 1;
+        while (last < extents.size() && extents[last].first == end)
+        {
+            end = extents[last++].second;
+        }
+        reclaimBlocks(extents[first].first, end);
+        first = last;
     }
     updateSB();
 }
 
-void fs_read(char name[5], int block_num)
+// File inode of name for a range of count blocks from block_num, -1 after printing the error.
+// The inode lock is taken into guard before its size is checked.
+int FileSystem::rangeInode(char name[5], int block_num, int count, bool exclusive, RWGuard &guard)
 {
-    if (!MOUNTED)
+    if (!mounted)
     {
-        cerr << "Error: No file system is mounted" << endl;
-        return;
+        *err << "Error: No file system is mounted" << endl;
+        return -1;
     }
 
     // Check if file is under the working directory
     int inodeID = inodeSearch(name);
-    if (inodeID < 0 || bitset<8>(SUPER_BLOCK->inode[inodeID].dir_parent).test(7))
+    if (inodeID < 0 || superBlock->inode[inodeID].dir)
     {
-        cerr << "Error: File " << name << " does not exist" << endl;
-        ;
-        return;
+        *err << "Error: File " << name << " does not exist" << endl;
+        return -1;
     }
+    guard.acquire(inodeLock(inodeID), exclusive);
 
-    // Check block size
-    if (block_num >= 0 && (ulong)block_num < bitset<7>(SUPER_BLOCK->inode[inodeID].used_size).to_ulong())
+    // Check the range against the file size
+    int64_t size = superBlock->inode[inodeID].used_size;
+    if (block_num < 0 || block_num >= size)
     {
-        // Attempt to read the block of the file
-        __off_t offset = (SUPER_BLOCK->inode[inodeID].start_block + block_num) * BLOCK_SIZE;
-        if (pread(FILE_DESCRIPTOR, BUFFER, BLOCK_SIZE, offset) < 0)
-        {
-            cerr << "Error: Cannot read from block" << endl;
-            return;
-        }
+        *err << name << " does not have block " << block_num << endl;
+        return -1;
     }
-    else
+    if ((int64_t)block_num + count > size)
     {
-        // Block_num < 0 or more than the file size
-        cerr << name << " does not have block " << block_num << endl;
+        *err << name << " does not have block " << size << endl;
+        return -1;
     }
+    return inodeID;
 }
 
-void fs_write(char name[5], int block_num)
+void FileSystem::readRange(char name[5], int block_num, int count, char *buffer)
 {
-    if (!MOUNTED)
+    Metrics::Timer timer(counters, Metrics::READ_RANGE);
+    if (count <= 0)
+    {
+        return;
+    }
+    ShardedRWGuard dir(dirLock, false);
+    RWGuard file;
+    int inodeID = rangeInode(name, block_num, count, false, file);
+    if (inodeID < 0)
     {
-        cerr << "Error: No file system is mounted" << endl;
         return;
     }
 
-    // Check if file is under the working directory
-    int inodeID = inodeSearch(name);
-    if (inodeID < 0 || bitset<8>(SUPER_BLOCK->inode[inodeID].dir_parent).test(7))
+    uint64_t block = (uint64_t)superBlock->inode[inodeID].start_block + block_num;
+    Metrics::Site site(Metrics::SITE_READ);
+    if (!blockCache.readRange(block, count, buffer))
+    {
+        *err << "Error: Cannot read from block" << endl;
+    }
+}
+
+void FileSystem::writeRange(char name[5], int block_num, int count, const char *buffer)
+{
+    Metrics::Timer timer(counters, Metrics::WRITE_RANGE);
+    if (count <= 0)
+    {
+        return;
+    }
+    ShardedRWGuard dir(dirLock, false);
+    RWGuard file;
+    int inodeID = rangeInode(name, block_num, count, true, file);
+    if (inodeID < 0)
+    {
+        return;
+    }
+
+    uint64_t block = (uint64_t)superBlock->inode[inodeID].start_block + block_num;
+    Metrics::Site site(Metrics::SITE_WRITE);
+    counters.requested((uint64_t)count * BLOCK_SIZE);
+    if (!blockCache.writeRange(block, count, buffer))
+    {
+        *err << "Error: Cannot write to block." << endl;
+    }
+}
+
+// Print an error if slot is not a buffer slot
+bool FileSystem::validSlot(int slot)
+{
+    if (slot < 0 || (size_t)slot >= buffers.size())
+    {
+        *err << "Error: Buffer slot " << slot << " does not exist" << endl;
+        return false;
+    }
+    return true;
+}
+
+void FileSystem::slotBuff(int slot, char buff[1024])
+{
+    Metrics::Timer timer(counters, Metrics::BUFF);
+    ShardedRWGuard dir(dirLock, false);
+
+    if (!mounted)
+    {
+        *err << "Error: No file system is mounted" << endl;
+        return;
+    }
+    if (!validSlot(slot))
     {
-        cerr << "Error: File " << name << " does not exist" << endl;
         return;
     }
 
-    // Check block size
-    if (block_num >= 0 && (ulong)block_num < bitset<7>(SUPER_BLOCK->inode[inodeID].used_size).to_ulong())
+    // Fill the slot with user's buffer, will override
+    char *buffer = buffers.resize(slot, 1);
+    memset(buffer, 0, 1024);
+    strncpy(buffer, buff, BLOCK_SIZE);
+}
+
+void FileSystem::slotRead(int slot, char name[5], int block_num, int count)
+{
+    Metrics::Timer timer(counters, Metrics::READ);
+    if (!validSlot(slot) || count <= 0)
     {
-        // Attempt to read the block of the file
-        int offset = (SUPER_BLOCK->inode[inodeID].start_block + block_num) * BLOCK_SIZE;
-        updateBlock(FILE_DESCRIPTOR, BUFFER, offset);
-        // Done
         return;
     }
-    else
+    ShardedRWGuard dir(dirLock, false);
+    RWGuard file;
+    int inodeID = rangeInode(name, block_num, count, false, file);
+    if (inodeID < 0)
+    {
+        return;
+    }
+
+    uint64_t block = (uint64_t)superBlock->inode[inodeID].start_block + block_num;
+    Metrics::Site site(Metrics::SITE_READ);
+    if (!blockCache.readRange(block, count, buffers.resize(slot, count)))
     {
-        // Block_num < 0 or more than the file size
-        cerr << name << " does not have block " << block_num << endl;
+        *err << "Error: Cannot read from block" << endl;
     }
 }
 
-void fs_buff(char buff[1024])
+void FileSystem::slotWrite(int slot, char name[5], int block_num, int count)
 {
-    if (!MOUNTED)
+    Metrics::Timer timer(counters, Metrics::WRITE);
+    if (!validSlot(slot) || count <= 0)
+    {
+        return;
+    }
+    ShardedRWGuard dir(dirLock, false);
+    RWGuard file;
+    int inodeID = rangeInode(name, block_num, count, true, file);
+    if (inodeID < 0)
     {
-        cerr << "Error: No file system is mounted" << endl;
         return;
     }
 
-    // Fill BUFFER with user's buffer, will override
-    memset(BUFFER, 0, 1024);
-    strncpy(BUFFER, buff, BLOCK_SIZE);
+    uint64_t block = (uint64_t)superBlock->inode[inodeID].start_block + block_num;
+    Metrics::Site site(Metrics::SITE_WRITE);
+    counters.requested((uint64_t)count * BLOCK_SIZE);
+    if (!blockCache.writeRange(block, count, buffers.repeat(slot, count)))
+    {
+        *err << "Error: Cannot write to block." << endl;
+    }
 }
 
-void fs_ls(void)
+void FileSystem::read(char name[5], int block_num)
+{
+    slotRead(0, name, block_num, 1);
+}
+
+void FileSystem::write(char name[5], int block_num)
+{
+    slotWrite(0, name, block_num, 1);
+}
+
+void FileSystem::buff(char buff[1024])
+{
+    slotBuff(0, buff);
+}
+
+void FileSystem::ls(void)
 {
-    if (!MOUNTED)
+    Metrics::Timer timer(counters, Metrics::LS);
+    ShardedRWGuard dir(dirLock, false);
+
+    if (!mounted)
     {
-        cerr << "Error: No file system is mounted" << endl;
+        *err << "Error: No file system is mounted" << endl;
         return;
     }
 
-    map<string, vector<int>>::iterator it = FILE_TREE.find(CURR_DIRECTORY_STRING);
-    if (it != FILE_TREE.end())
+    // The parent of the root directory is itself
+    uint32_t parent = currDirectory == superBlock->root ? superBlock->root : superBlock->inode[currDirectory].dir_parent;
+    print("%-5s %3d\n", ".", (int)fileTree.count(currDirectory) + 2);
+    print("%-5s %3d\n", "..", (int)fileTree.count(parent) + 2);
+
+    const list<int> &entries = fileTree.children(currDirectory);
+    for (list<int>::const_iterator it = entries.begin(); it != entries.end(); it++)
     {
-        printf("%-5s %3d\n", ".", (int)FILE_TREE[CURR_DIRECTORY_STRING].size() + 2);
-        printf("%-5s %3d\n", "..", (int)FILE_TREE[back_directory(CURR_DIRECTORY_STRING)].size() + 2);
+        // A resize may be changing the size
+        RWGuard file(inodeLock(*it), false);
 
-        vector<int>::iterator int_it = FILE_TREE[CURR_DIRECTORY_STRING].begin();
-        for (; int_it != FILE_TREE[CURR_DIRECTORY_STRING].end(); int_it++)
+        // Check if directory
+        // Directory print size
+        if (superBlock->inode[*it].dir)
         {
-            // Check if directory
-            // Directory print size
-            if (bitset<8>(SUPER_BLOCK->inode[*int_it].dir_parent).test(7))
-            {
-                // Directory
-                string next_dir = CURR_DIRECTORY_STRING + string(SUPER_BLOCK->inode[*int_it].name, 5).c_str() + "/";
-                printf("%-5.5s %3d\n", SUPER_BLOCK->inode[*int_it].name, (int)FILE_TREE[next_dir].size() + 2);
-            }
-            else
-            {
-                // File
-                printf("%-5.5s %3d KB\n", SUPER_BLOCK->inode[*int_it].name, (int)bitset<8>(SUPER_BLOCK->inode[*int_it].used_size).set(7, 0).to_ulong());
-            }
+            // Directory
+            print("%-5.5s %3d\n", superBlock->inode[*it].name, (int)fileTree.count(*it) + 2);
+        }
+        else
+        {
+            // File
+            print("%-5.5s %3d KB\n", superBlock->inode[*it].name, (int)superBlock->inode[*it].used_size);
         }
     }
 }
 
-void fs_cd(char name[5])
+void FileSystem::cd(char name[5])
 {
-    if (!MOUNTED)
+    Metrics::Timer timer(counters, Metrics::CD);
+    ShardedRWGuard dir(dirLock, true);
+
+    if (!mounted)
     {
-        cerr << "Error: No file system is mounted" << endl;
+        *err << "Error: No file system is mounted" << endl;
         return;
     }
 
-    // Check if name is . or ..SUPER_BLOCK->inode[inodeID].used_size;
-    string dir_name(name, 5);
-    if (strcmp(dir_name.c_str(), ".") == 0)
+    // Check if name is . or ..
+    if (strncmp(name, ".", 5) == 0)
     {
         // Do nothing
         return;
     }
-    else if (strcmp(dir_name.c_str(), "..") == 0)
+    else if (strncmp(name, "..", 5) == 0)
     {
         // Go back on directory, if root do nothing
-        CURR_DIRECTORY_STRING = back_directory(CURR_DIRECTORY_STRING);
-        if (strcmp(CURR_DIRECTORY_STRING.c_str(), "root/") == 0)
+        if (currDirectory != superBlock->root)
         {
-            CURR_DIRECTORY.reset();
-            CURR_DIRECTORY |= bitset<8>("0111111");
-        }
-        else
-        {
-            // Look for the inode of this back directory
-            string directory = back_directory(CURR_DIRECTORY_STRING);
-            vector<int>::iterator it = FILE_TREE[directory].begin();
-            string directoryName = tokenize(CURR_DIRECTORY_STRING, "/").back();
-            for (;it != FILE_TREE[directory].end(); it++)
-            {
-                if (strcmp(directoryName.c_str(), SUPER_BLOCK->inode[*it].name) == 0)
-                {
-                    // Change CURR_DIRECTORY
-                    CURR_DIRECTORY.reset();
-                    CURR_DIRECTORY |= bitset<8>(*it);
-                }
-            }
+            currDirectory = superBlock->inode[currDirectory].dir_parent;
         }
     }
     else
     {
         // If not, going forward to another directory
-        string dir = CURR_DIRECTORY_STRING + string(name, 5).c_str() + '/';
-        map<string, vector<int>>::iterator it = FILE_TREE.find(dir);
-
-        // Directories are unique
-        if (it != FILE_TREE.end())
-        {
-            // Directory found, Change directory
-            int inodeID = inodeSearch(name);
-            if (inodeID < 0)
-            {
-                cerr << "Error: File or directory ";
-                cerr.write(name, 5) << " does not exist" << endl;
-                return;
-            }
-            else
-            {
-                // Change CURR_DIRECTORY
-                CURR_DIRECTORY.reset();
-                CURR_DIRECTORY |= bitset<8>(inodeID);
-                CURR_DIRECTORY_STRING = dir.c_str();
-            }
-        }
-        else
+        int inodeID = inodeSearch(name);
+        if (inodeID < 0 || !superBlock->inode[inodeID].dir)
         {
             // Don't change directory
-            cerr << "Error: Directory " << name << " does not exist" << endl;
+            *err << "Error: Directory " << name << " does not exist" << endl;
             return;
         }
+
+        // Change currDirectory
+        currDirectory = inodeID;
     }
 }
 
-void fs_resize(char name[5], int new_size)
+void FileSystem::resize(char name[5], int new_size)
 {
-    if (!MOUNTED)
+    Metrics::Timer timer(counters, Metrics::RESIZE);
+    ShardedRWGuard dir(dirLock, false);
+
+    if (!mounted)
     {
-        cerr << "Error: No file system is mounted" << endl;
+        *err << "Error: No file system is mounted" << endl;
         return;
     }
 
-    // Recount the empty blocks
-    // Get inodes within the current directory
-    vector<int>::iterator it = FILE_TREE[CURR_DIRECTORY_STRING].begin();
-    int inodeID;
-    bool found;
-    for (; it != FILE_TREE[CURR_DIRECTORY_STRING].end(); it++)
-    {
-        // File name matches given name
-        // Inode's type is a file, 0
-        if (strncmp(SUPER_BLOCK->inode[*it].name, name, 5) == 0 && !bitset<8>(SUPER_BLOCK->inode[*it].dir_parent).test(7))
-        {
-            inodeID = *it;
-            found = true;
-            break;
-        }
-    }
+    // Inode's type must be a file
+    int inodeID = inodeSearch(name);
+    bool found = inodeID >= 0 && !superBlock->inode[inodeID].dir;
 
     // No file of given name found
     if (!found)
     {
-        cerr << "Error: File " << name << " does not exist" << endl;
+        *err << "Error: File " << name << " does not exist" << endl;
+        return;
+    }
+
+    // A negative size would free blocks before the file, nothing is changed
+    if (new_size < 0)
+    {
+        *err << "Error: File " << name << " cannot be resized to size " << new_size << endl;
         return;
     }
 
+    // Readers and writers of the file wait, the free-space list is shared with the other resizes
+    RWGuard file(inodeLock(inodeID), true);
+    lock_guard<mutex> space(spaceLock);
+
     // Calculate new tail of Inode
-    int size = bitset<7>(SUPER_BLOCK->inode[inodeID].used_size).to_ulong();
-    int start = SUPER_BLOCK->inode[inodeID].start_block;
+    int size = superBlock->inode[inodeID].used_size;
+    int start = superBlock->inode[inodeID].start_block;
     int end = start + size;
     int newEnd = start + new_size;
 
@@ -549,90 +810,553 @@ void fs_resize(char name[5], int new_size)
     if (new_size < size)
     {
         // Shrink
-        // Zero out data block by writing
-        for (int i = newEnd; i < end; i++)
-        {
-            char emptyBuff[1024];
-            memset(emptyBuff, 0, 1024);
-            updateBlock(FILE_DESCRIPTOR, emptyBuff, newEnd * BLOCK_SIZE);
-        }
+        // Zero out the data blocks past the new end
+        reclaimBlocks(newEnd, end);
 
         // Modify free_block_list
-        set_block_list(SUPER_BLOCK->free_block_list, newEnd, end, false);
+        freeBlocks(newEnd, end);
 
         // Assign new values to Inode
-        SUPER_BLOCK->inode[inodeID].used_size = (uint8_t)bitset<8>(bitset<8>(new_size) | bitset<8>("10000000")).to_ulong();
+        superBlock->inode[inodeID].used_size = new_size;
+        markInode(superBlock, inodeID);
     }
     else if (new_size == size)
     {
         // Do nothing
         return;
     }
+    else if (freeExtents.extentAt(end) >= (size_t)(new_size - size))
+    {
+        // Enough free blocks after the last block, grow in place
+        useBlocks(end, newEnd);
+        superBlock->inode[inodeID].used_size = new_size;
+        markInode(superBlock, inodeID);
+    }
     else
     {
         // fake delete from the block list to see if we can resize at somewhere else
-        set_block_list(SUPER_BLOCK->free_block_list, start, end, false);
-        int newStart = empty_block_finder(contigous_count(SUPER_BLOCK->free_block_list), new_size);
+        freeBlocks(start, end);
+        int newStart = freeExtents.firstFit(new_size);
 
         // Nowhere to put it
         if (newStart < 0)
         {
             // Put it back
-            set_block_list(SUPER_BLOCK->free_block_list, start, end, true);
-            cerr << "Error: File ";
-            cerr.write(name, 5) << " cannot expand to size " << new_size << endl;
+            useBlocks(start, end);
+            *err << "Error: File ";
+            err->write(name, 5) << " cannot expand to size " << new_size << endl;
             return;
         }
 
-        // Move the file
+        // Move the file, the new place is taken first so queued zeroing cannot land on it
         newEnd = newStart + new_size;
-        moveDB(FILE_DESCRIPTOR, start, end, newStart, newStart + size);
-        set_block_list(SUPER_BLOCK->free_block_list, start, end, false);
-        set_block_list(SUPER_BLOCK->free_block_list, newStart, newEnd, true);
+        useBlocks(newStart, newEnd);
+        Metrics::Site site(Metrics::SITE_MOVE);
+        if (!moveDB(&blockCache, start, end, newStart, newStart + size))
+        {
+            *err << "Error: Cannot write to block." << endl;
+        }
 
         // Assign new values to Inode
-        SUPER_BLOCK->inode[inodeID].start_block = newStart;
-        SUPER_BLOCK->inode[inodeID].used_size = (uint8_t)bitset<8>(bitset<8>(new_size) | bitset<8>("10000000")).to_ulong();
+        superBlock->inode[inodeID].start_block = newStart;
+        superBlock->inode[inodeID].used_size = new_size;
+        markInode(superBlock, inodeID);
     }
     updateSB();
 }
-void fs_defrag(void)
+
+// Blocks of the old places of the planned files that no file covers after the moves
+static void vacatedBlocks(const vector<FS_move> &plan, uint32_t end, vector<pair<uint32_t, uint32_t>> &ranges)
 {
-    if (!MOUNTED)
+    ranges.clear();
+    for (size_t i = 0; i < plan.size(); i++)
     {
-        cerr << "Error: No file system is mounted" << endl;
+        uint32_t first = max(plan[i].from, end);
+        uint32_t last = plan[i].from + plan[i].size;
+        if (first >= last)
+        {
+            continue;
+        }
+        // The plan is in block order, neighbours merge into one range
+        if (!ranges.empty() && ranges.back().second == first)
+        {
+            ranges.back().second = last;
+        }
+        else
+        {
+            ranges.push_back(make_pair(first, last));
+        }
+    }
+}
+
+void FileSystem::defrag(void)
+{
+    Metrics::Timer timer(counters, Metrics::DEFRAG);
+    ShardedRWGuard dir(dirLock, true);
+
+    if (!mounted)
+    {
+        *err << "Error: No file system is mounted" << endl;
         return;
     }
-    map<int, int> contigous_blocks = contigous_count(SUPER_BLOCK->free_block_list);
-    map<int, int>::iterator it = contigous_blocks.begin();
-    while (contigous_blocks.size() > 1)
+
+    vector<FS_move> plan;
+    uint32_t end = planDefrag(superBlock, plan);
+
+    // Every file moves once, straight to its final place. Queued zeroing of the
+    // new place is dropped, the move overwrites it.
+    uint32_t last = 0;
+    vector<pair<uint32_t, uint32_t>> queued;
+    for (size_t i = 0; i < plan.size(); i++)
     {
-        // All inodes
-        for (int i = 0; i < 126; i++)
+        takeQueued(plan[i].to, plan[i].to + plan[i].size, queued);
+        Metrics::Site site(Metrics::SITE_MOVE);
+        if (!blockCache.move(plan[i].from, plan[i].to, plan[i].size))
         {
-            if (it->second <= SUPER_BLOCK->inode[i].start_block)
-            {
-                // Move this block
-                int start = SUPER_BLOCK->inode[i].start_block;
-                int size = (int)bitset<7>(SUPER_BLOCK->inode[i].used_size).to_ulong();
-                int end = start + size;
-                int newStart = start - it->first;
-                int newEnd = end - it->first;
-                SUPER_BLOCK->inode[i].start_block = newStart;
-                moveDB(FILE_DESCRIPTOR, start, end, newStart, newEnd);
-                set_block_list(SUPER_BLOCK->free_block_list, start, end, false);
-                set_block_list(SUPER_BLOCK->free_block_list, newStart, newEnd, true);
-            }
+            *err << "Error: Cannot write to block." << endl;
         }
-        // Reset
-        updateSB();
-        contigous_blocks = contigous_count(SUPER_BLOCK->free_block_list);
-        it = contigous_blocks.begin();
+        superBlock->inode[plan[i].inode].start_block = plan[i].to;
+        markInode(superBlock, plan[i].inode);
+        last = max(last, plan[i].from + plan[i].size);
+    }
+
+    // Zero out what is left of the old places
+    vector<pair<uint32_t, uint32_t>> vacated;
+    vacatedBlocks(plan, end, vacated);
+    for (size_t i = 0; i < vacated.size(); i++)
+    {
+        reclaimBlocks(vacated[i].first, vacated[i].second);
+    }
+
+    // A running incremental defragmentation is finished too
+    if (superBlock->defrag_blocks > 0)
+    {
+        superBlock->defrag_blocks = 0;
+        superBlock->defrag_files = 0;
+        superBlock->dirty_header = true;
+    }
+
+    // Every data block before end is in use, the rest is free
+    if (!plan.empty())
+    {
+        uint32_t start = superBlock->data_start;
+        superBlock->free_block_list.clear(start, last);
+        superBlock->free_block_list.set(start, end);
+        markBlocks(superBlock, start, last);
+        freeExtents.build(superBlock->free_block_list, start);
+    }
+    updateSB();
+}
+
+void FileSystem::defragStart(uint32_t blocks, uint32_t files)
+{
+    Metrics::Timer timer(counters, Metrics::DEFRAG_START);
+    ShardedRWGuard dir(dirLock, true);
+
+    if (!mounted)
+    {
+        *err << "Error: No file system is mounted" << endl;
+        return;
+    }
+    superBlock->defrag_blocks = blocks;
+    superBlock->defrag_files = files;
+    superBlock->dirty_header = true;
+    updateSB();
+}
+
+bool FileSystem::defragStep(void)
+{
+    ShardedRWGuard dir(dirLock, true);
+
+    if (!mounted || superBlock->defrag_blocks == 0)
+    {
+        return false;
+    }
+    // Only the steps of a running defragmentation count, the script runner calls it after every line
+    Metrics::Timer timer(counters, Metrics::DEFRAG_STEP);
+    Timeline::Span span("defrag step");
+
+    // The plan is computed again every step, the commands in between may have changed the layout
+    vector<FS_move> plan;
+    planDefrag(superBlock, plan);
+
+    // A file always moves whole, one larger than the block budget moves alone
+    uint32_t blocks = 0;
+    size_t step = 0;
+    while (step < plan.size() && step < superBlock->defrag_files)
+    {
+        if (step > 0 && blocks + plan[step].size > superBlock->defrag_blocks)
+        {
+            break;
+        }
+        blocks += plan[step].size;
+        step++;
+    }
+
+    // Files before this one are in their final place, so the new place holds only free
+    // blocks and the file's own ones. The superblock is consistent after every file.
+    for (size_t i = 0; i < step; i++)
+    {
+        const FS_move &move = plan[i];
+        freeBlocks(move.from, move.from + move.size);
+        useBlocks(move.to, move.to + move.size);
+        Metrics::Site site(Metrics::SITE_MOVE);
+        if (!moveDB(&blockCache, move.from, move.from + move.size, move.to, move.to + move.size))
+        {
+            *err << "Error: Cannot write to block." << endl;
+        }
+        superBlock->inode[move.inode].start_block = move.to;
+        markInode(superBlock, move.inode);
+    }
+
+    bool done = step == plan.size();
+    if (done)
+    {
+        superBlock->defrag_blocks = 0;
+        superBlock->defrag_files = 0;
+        superBlock->dirty_header = true;
     }
     updateSB();
+    return !done;
+}
+
+void FileSystem::defragDryRun(void)
+{
+    Metrics::Timer timer(counters, Metrics::DEFRAG_DRY_RUN);
+    ShardedRWGuard dir(dirLock, true);
+
+    if (!mounted)
+    {
+        *err << "Error: No file system is mounted" << endl;
+        return;
+    }
+
+    vector<FS_move> plan;
+    uint32_t end = planDefrag(superBlock, plan);
+
+    uint64_t moved = 0;
+    for (size_t i = 0; i < plan.size(); i++)
+    {
+        moved += plan[i].size;
+    }
+    vector<pair<uint32_t, uint32_t>> vacated;
+    vacatedBlocks(plan, end, vacated);
+    uint64_t zeroed = 0;
+    for (size_t i = 0; i < vacated.size(); i++)
+    {
+        zeroed += vacated[i].second - vacated[i].first;
+    }
+
+    // Each moved block is read and written once, each vacated block written once
+    *out << "Defrag: " << plan.size() << " files, " << moved << " blocks to move, "
+         << (2 * moved + zeroed) * BLOCK_SIZE << " bytes of I/O" << endl;
+}
+
+void FileSystem::unmount(void)
+{
+    Metrics::Timer timer(counters, Metrics::UNMOUNT);
+    ShardedRWGuard dir(dirLock, true);
+    sync();
+    saveSnapshot();
+    blockCache.attach(nullptr);
+    delete disk;
+    disk = nullptr;
+    delete superBlock;
+    superBlock = nullptr;
+    mounted = false;
+}
+
+void FileSystem::flush(void)
+{
+    Metrics::Timer timer(counters, Metrics::FLUSH);
+    ShardedRWGuard dir(dirLock, true);
+    sync();
+}
+
+void FileSystem::sync(void)
+{
+    if (!mounted)
+    {
+        return;
+    }
+    drainQueued();
+    writeback();
+    Metrics::Site site(Metrics::SITE_CACHE);
+    if (!disk->sync())
+    {
+        *err << "Error: Cannot write to block." << endl;
+    }
+}
+
+void FileSystem::saveSnapshot(void)
+{
+    if (!mounted || !snapshots)
+    {
+        return;
+    }
+
+    // Only a consistent superblock may skip the check of the next mount
+    Timeline::Span span("snapshot save");
+    string path = Snapshot::path(diskName);
+    if (ccheck(superBlock) != 0 || !Snapshot::save(path.c_str(), superBlock, disk->descriptor()))
+    {
+        ::remove(path.c_str());
+    }
+}
+
+void FileSystem::batchBegin(void)
+{
+    Metrics::Timer timer(counters, Metrics::BATCH_BEGIN);
+    ShardedRWGuard dir(dirLock, true);
+    batch = true;
+}
+
+void FileSystem::batchEnd(void)
+{
+    Metrics::Timer timer(counters, Metrics::BATCH_END);
+    ShardedRWGuard dir(dirLock, true);
+    batch = false;
+    sync();
+}
+
+int FileSystem::maxSize(void)
+{
+    ShardedRWGuard dir(dirLock, false);
+
+    if (!mounted)
+    {
+        return 127;
+    }
+    return (int)superBlock->max_size;
+}
+
+void FileSystem::setCacheCapacity(size_t blocks)
+{
+    ShardedRWGuard dir(dirLock, true);
+
+    // The cache stays off until the concurrent mode ends
+    if (concurrent)
+    {
+        cacheCapacity = blocks;
+        return;
+    }
+    if (!blockCache.setCapacity(blocks))
+    {
+        *err << "Error: Cannot write to block." << endl;
+    }
+}
+
+void FileSystem::setConcurrent(bool enabled)
+{
+    ShardedRWGuard dir(dirLock, true);
+
+    if (enabled == concurrent)
+    {
+        return;
+    }
+
+    // The block cache is not shared between threads, it is written back and turned off
+    size_t capacity = enabled ? 0 : cacheCapacity;
+    if (enabled)
+    {
+        cacheCapacity = blockCache.capacity();
+    }
+    if (!blockCache.setCapacity(capacity))
+    {
+        *err << "Error: Cannot write to block." << endl;
+    }
+    concurrent = enabled;
+}
+
+void FileSystem::printMetrics(bool json)
+{
+    ShardedRWGuard dir(dirLock, false);
+    counters.print(*out, json);
+}
+
+BlockCache::Stats FileSystem::cacheStats(void)
+{
+    ShardedRWGuard dir(dirLock, false);
+    return blockCache.stats();
+}
+
+void FileSystem::setMountMmap(bool enabled)
+{
+    ShardedRWGuard dir(dirLock, true);
+    mapDisk = enabled;
+}
+
+void FileSystem::setMountSnapshot(bool enabled)
+{
+    ShardedRWGuard dir(dirLock, true);
+    snapshots = enabled;
+}
+
+void FileSystem::setDeferredZero(bool enabled)
+{
+    ShardedRWGuard dir(dirLock, true);
+    deferZero = enabled;
+    if (!enabled && mounted)
+    {
+        drainQueued();
+        updateSB();
+    }
+}
+
+FileSystem &fs_default(void)
+{
+    static FileSystem instance;
+    return instance;
+}
+
+// The fs_* API runs on the default instance
+
+void fs_mount(char *new_disk_name)
+{
+    fs_default().mount(new_disk_name);
+}
+
+void fs_create(char name[5], int size)
+{
+    fs_default().create(name, size);
+}
+
+void fs_delete(char name[5])
+{
+    fs_default().remove(name);
+}
+
+void fs_read(char name[5], int block_num)
+{
+    fs_default().read(name, block_num);
+}
+
+void fs_write(char name[5], int block_num)
+{
+    fs_default().write(name, block_num);
+}
+
+void fs_read_range(char name[5], int block_num, int count, char *buffer)
+{
+    fs_default().readRange(name, block_num, count, buffer);
+}
+
+void fs_write_range(char name[5], int block_num, int count, const char *buffer)
+{
+    fs_default().writeRange(name, block_num, count, buffer);
+}
+
+void fs_buff(char buff[1024])
+{
+    fs_default().buff(buff);
+}
+
+void fs_slot_buff(int slot, char buff[1024])
+{
+    fs_default().slotBuff(slot, buff);
+}
+
+void fs_slot_read(int slot, char name[5], int block_num, int count)
+{
+    fs_default().slotRead(slot, name, block_num, count);
+}
+
+void fs_slot_write(int slot, char name[5], int block_num, int count)
+{
+    fs_default().slotWrite(slot, name, block_num, count);
+}
+
+void fs_ls(void)
+{
+    fs_default().ls();
+}
+
+void fs_resize(char name[5], int new_size)
+{
+    fs_default().resize(name, new_size);
+}
+
+void fs_defrag(void)
+{
+    fs_default().defrag();
+}
+
+void fs_defrag_start(uint32_t blocks, uint32_t files)
+{
+    fs_default().defragStart(blocks, files);
+}
+
+bool fs_defrag_step(void)
+{
+    return fs_default().defragStep();
+}
+
+void fs_defrag_dry_run(void)
+{
+    fs_default().defragDryRun();
+}
+
+void fs_cd(char name[5])
+{
+    fs_default().cd(name);
 }
 
 void fs_free()
 {
-    delete SUPER_BLOCK;
-}
\ No newline at end of file
+    fs_default().unmount();
+}
+
+void fs_flush(void)
+{
+    fs_default().flush();
+}
+
+void fs_batch_begin(void)
+{
+    fs_default().batchBegin();
+}
+
+void fs_batch_end(void)
+{
+    fs_default().batchEnd();
+}
+
+int fs_max_size(void)
+{
+    return fs_default().maxSize();
+}
+
+void fs_cache_capacity(size_t blocks)
+{
+    fs_default().setCacheCapacity(blocks);
+}
+
+void fs_metrics(bool json)
+{
+    fs_default().printMetrics(json);
+}
+
+BlockCache::Stats fs_cache_stats(void)
+{
+    return fs_default().cacheStats();
+}
+
+void fs_mount_mmap(bool enabled)
+{
+    fs_default().setMountMmap(enabled);
+}
+
+void fs_mount_snapshot(bool enabled)
+{
+    fs_default().setMountSnapshot(enabled);
+}
+
+void fs_deferred_zero(bool enabled)
+{
+    fs_default().setDeferredZero(enabled);
+}
+
+void fs_concurrent(bool enabled)
+{
+    fs_default().setConcurrent(enabled);
+}
@@ -1,6 +1,25 @@
+#ifndef FILE_SYSTEM_H
+#define FILE_SYSTEM_H
+
 #include <stdio.h>
 #include <stdint.h>
 
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BlockCache.h"
+#include "BufferPool.h"
+#include "DirIndex.h"
+#include "Disk.h"
+#include "FreeExtents.h"
+#include "Metrics.h"
+#include "RWLock.h"
+
+// Format v1: 128 blocks of 1KB, the superblock is block 0
 typedef struct {
 	char name[5];        // Name of the file or directory
 	uint8_t used_size;   // Inode state and the size of the file or directory
@@ -13,6 +32,41 @@ typedef struct {
 	Inode inode[126];
 } Super_block;
 
+/**
+ * Format v2: the superblock spans several blocks. Block 0 holds the header below,
+ * followed by the free-space bitmap region (one bit per block, same bit order as v1)
+ * and the inode table. Data blocks start at data_start. All integers are little-endian.
+ */
+#define FS_V2_MAGIC "FSV2"
+#define FS_V2_INODE_SIZE 32
+#define FS_V2_ROOT 0xFFFFFFFF // dir_parent of the entries in the root directory
+
+typedef struct {
+	char magic[4];          // FS_V2_MAGIC
+	uint32_t version;       // 2
+	uint32_t block_size;    // 1024
+	uint32_t num_blocks;    // Blocks on the disk, including the superblock
+	uint32_t num_inodes;    // Inodes in the inode table
+	uint32_t bitmap_start;  // First block of the free-space bitmap
+	uint32_t bitmap_blocks; // Blocks in the free-space bitmap
+	uint32_t inode_start;   // First block of the inode table
+	uint32_t inode_blocks;  // Blocks in the inode table
+	uint32_t data_start;    // First data block
+	uint32_t defrag_blocks; // Incremental defragmentation budget per step, 0 when none is running
+	uint32_t defrag_files;
+} Super_block_v2;
+
+// Inode table entry, FS_V2_INODE_SIZE bytes on disk
+typedef struct {
+	char name[5];         // Name of the file or directory
+	uint8_t state;        // Bit 7: in use, bit 6: directory
+	uint16_t reserved;
+	uint32_t dir_parent;  // Index of the parent inode, FS_V2_ROOT for the root directory
+	uint32_t used_size;   // Size of the file in blocks
+	uint64_t start_block; // Index of the start file block
+	uint64_t reserved2;
+} Inode_v2;
+
 /**
  * Mounts the file system residing on the virtual disk with the specified name. The mounting process involves
 loading the superblock of the file system, but before doing this, you should check if there exists a file (i.e.,
@@ -48,6 +102,9 @@ Note that you should report this error only if the command is valid but no file
 command is not valid, you should just print the command error (described earlier).
 If the disk exists and the residing file system is consistent, you can proceed to loading the superblock and set
 the current working directory to the root directory. Do not flush the buffer when mounting a file system.
+
+The on-disk format is detected from block 0: a disk that starts with FS_V2_MAGIC is read as format v2,
+anything else as format v1.
  * 
 */
 void fs_mount(char *new_disk_name);
@@ -106,11 +163,34 @@ Error: <file name> does not have block <block_num>
  */ 
 void fs_write(char name[5], int block_num);
 
+/**
+ * Reads or writes count consecutive blocks of a file, starting at its block num-th block, from or into
+ * buffer, which holds count * 1024 bytes. The run is transferred with one disk read or write. The errors
+ * are the ones of fs_read() and fs_write(); when the run does not fit in the file, <block_num> is the
+ * first block of the run the file does not have. A count of 0 or less transfers nothing.
+ */
+void fs_read_range(char name[5], int block_num, int count, char *buffer);
+void fs_write_range(char name[5], int block_num, int count, const char *buffer);
+
 /**
  *•Flushes the buffer by setting it to zero and writes the new bytes into the buffer. No errors must be handled in
  this function.
  */  
 void fs_buff(char buff[1024]);
+
+/**
+ * Numbered buffer slots, [0, FS_BUFFER_SLOTS). Slot 0 is the buffer of fs_buff(), fs_read() and fs_write().
+ * fs_slot_buff() fills a slot like fs_buff() and leaves it one block long. fs_slot_read() reads count blocks
+ * of a file from its block num-th block into a slot, which then holds count blocks. fs_slot_write() writes
+ * count blocks of a slot to the file, a slot holding fewer blocks is repeated. The errors are the ones of
+ * fs_read_range() and fs_write_range(), and "Error: Buffer slot <slot> does not exist".
+ */
+#define FS_BUFFER_SLOTS 16
+
+void fs_slot_buff(int slot, char buff[1024]);
+void fs_slot_read(int slot, char name[5], int block_num, int count);
+void fs_slot_write(int slot, char name[5], int block_num, int count);
+
 void fs_ls(void);
 
 /**
@@ -135,10 +215,36 @@ sequence allocated to this file. The starting block is not moved when decreasing
 the size attribute in the inode to the new size.
 
 Note: You can assume that new_size is greater than zero in fs_resize
+
+A negative new_size changes nothing and prints:
+Error: File <file name> cannot be resized to size <new size>
  */ 
 void fs_resize(char name[5], int new_size);
+
+/**
+ * Moves every file towards the start of the disk so the free blocks form one extent at the
+ * end. The plan is computed first: each file moves at most once, straight to its final place,
+ * and the superblock is written once.
+ */
 void fs_defrag(void);
 
+/**
+ * Incremental defragmentation. fs_defrag_start() records a budget per step (at most blocks
+ * blocks and files files; a file is never split, so one larger than the block budget moves
+ * alone). Each fs_defrag_step() moves the next files of the plan straight to their final
+ * place and writes the superblock, which is consistent after every step. It returns false
+ * once the disk is compact or no defragmentation is running. On v2 disks the budget is kept
+ * in the header, so a remount resumes the defragmentation.
+ */
+void fs_defrag_start(uint32_t blocks, uint32_t files);
+bool fs_defrag_step(void);
+
+/**
+ * Prints the plan fs_defrag() would run (files and blocks to move, bytes of I/O) to stdout
+ * without touching the disk.
+ */
+void fs_defrag_dry_run(void);
+
 /**
  * Changes the current working directory to a directory with the specified name in the current working directory.
 This directory can be ., .., or any directory the user created on the disk. If the specified directory does
@@ -148,4 +254,218 @@ Error: Directory <directory name> does not exist
 You can assume that the given name has no slash at the end.
  */ 
 void fs_cd(char name[5]);
-void fs_free();
\ No newline at end of file
+
+/**
+ * Writes the pending superblock changes and releases the mounted file system.
+ */
+void fs_free();
+
+/**
+ * Superblock writeback. Commands only record which inodes and free-space list bytes
+ * they change; the changed ranges are written when the command ends. Between
+ * fs_batch_begin() and fs_batch_end() the writes are held back so a batch of commands
+ * shares one write, done by fs_batch_end(), fs_flush(), the next fs_mount() or fs_free().
+ */
+void fs_flush(void);
+void fs_batch_begin(void);
+void fs_batch_end(void);
+
+/**
+ * Data block cache. Reads, writes, moves and zeroing of data blocks go through a
+ * write-back cache that is written by fs_flush(), the next fs_mount() and fs_free().
+ * fs_cache_capacity() writes it back and resizes it to the given number of 1KB blocks
+ * (256 by default, 0 turns it off). fs_cache_stats() returns its hit, miss, eviction
+ * and write back counters.
+ */
+void fs_cache_capacity(size_t blocks);
+BlockCache::Stats fs_cache_stats(void);
+
+/**
+ * Prints the counters kept since the program started to stdout, as a text table or as
+ * JSON: the calls and latency histogram (log2 buckets of ns) of every fs_* command, the
+ * calls, bytes and time of the disk reads, writes, copies, zeroing and syncs by the code
+ * that issued them (block reads and writes of files, superblock writeback, file moves,
+ * zeroing of freed blocks, block cache write back), and the write amplification: bytes
+ * written to the image over the bytes of data fs_write() and friends asked to write.
+ * Reads of the superblock by fs_mount() count in its latency only.
+ */
+void fs_metrics(bool json);
+
+/**
+ * Mount mode of the following fs_mount() calls. When enabled the whole disk image is
+ * mapped with mmap: block reads and writes are memory copies on the mapping, bypass the
+ * block cache and are made durable with msync by fs_flush(), fs_batch_end(), the next
+ * fs_mount() and fs_free(). An image that cannot be mapped is mounted with pread/pwrite,
+ * which is the default.
+ */
+void fs_mount_mmap(bool enabled);
+
+/**
+ * Mount snapshots. When enabled, fs_free() and a later fs_mount() save the directory
+ * index and free extents of a consistent disk next to its image, in <disk>.snap with a
+ * stamp of the image file. fs_mount() of an image that still has that stamp loads them
+ * instead of checking the disk and rebuilding them; another stamp, lists that do not
+ * match the superblock, or a missing or damaged file run the full consistency check.
+ * Off by default.
+ */
+void fs_mount_snapshot(bool enabled);
+
+/**
+ * Zeroing of freed data blocks. By default fs_delete(), a shrinking fs_resize() and
+ * fs_defrag() zero the blocks they free right away, each run of blocks with one hole
+ * punch (or one write where the host file system cannot punch holes). When enabled
+ * the runs are queued instead and zeroed by fs_flush(), fs_batch_end(), the next
+ * fs_mount() and fs_free(); a queued block that is allocated again is zeroed first.
+ * Disabling it zeroes the queue.
+ */
+void fs_deferred_zero(bool enabled);
+
+/**
+ * Thread-safe execution mode. Every command takes the locks it needs, always in this order:
+ * the directory lock, shared by the commands that only look names up (R, W, E, L and the
+ * range and slot versions) and exclusive for the others (M, C, D, Y, O, flushes and
+ * settings); one reader/writer lock per inode (inodes share a fixed set of locks), shared
+ * by reads and exclusive for writes and resizes; and the free-space lock, taken by resizes.
+ * So reads of any files run in parallel, writes of different files too, and a resize only
+ * waits for the users of its own file and for other resizes.
+ *
+ * The block cache is not shared between threads: enabling the mode writes it back and
+ * turns it off until the mode is disabled again. Each thread should use its own buffer
+ * slot, or fs_read_range()/fs_write_range() with a buffer of its own.
+ */
+void fs_concurrent(bool enabled);
+
+/**
+ * Largest file size (and block number + 1) the mounted format can store. 127 for v1 and
+ * when no file system is mounted.
+ */
+int fs_max_size(void);
+
+struct FS_super_block;
+
+/**
+ * A file system and everything it keeps while a disk is mounted: the disk, its superblock,
+ * directory index, free extents, block cache, buffer slots and current directory. Every
+ * method is the fs_* function of the same name on this instance, with the same messages,
+ * and separate instances share nothing, so one process can keep many disks mounted.
+ *
+ * The fs_* functions run on one default instance, see fs_default().
+ */
+class FileSystem
+{
+public:
+    FileSystem();
+    // Writes back and releases the mounted disk
+    ~FileSystem();
+
+    void mount(char *new_disk_name);
+    void create(char name[5], int size);
+    void remove(char name[5]);
+    void read(char name[5], int block_num);
+    void write(char name[5], int block_num);
+    void readRange(char name[5], int block_num, int count, char *buffer);
+    void writeRange(char name[5], int block_num, int count, const char *buffer);
+    void buff(char buff[1024]);
+    void slotBuff(int slot, char buff[1024]);
+    void slotRead(int slot, char name[5], int block_num, int count);
+    void slotWrite(int slot, char name[5], int block_num, int count);
+    void ls(void);
+    void resize(char name[5], int new_size);
+    void defrag(void);
+    void defragStart(uint32_t blocks, uint32_t files);
+    bool defragStep(void);
+    void defragDryRun(void);
+    void cd(char name[5]);
+    void unmount(void);
+    void flush(void);
+    void batchBegin(void);
+    void batchEnd(void);
+    void setCacheCapacity(size_t blocks);
+    BlockCache::Stats cacheStats(void);
+    void printMetrics(bool json);
+    void setMountMmap(bool enabled);
+    void setMountSnapshot(bool enabled);
+    void setDeferredZero(bool enabled);
+    void setConcurrent(bool enabled);
+    int maxSize(void);
+
+    // Streams of the messages and listings, std::cout and std::cerr by default
+    void setOutput(std::ostream &out, std::ostream &err);
+
+    bool isMounted(void) const { return mounted; }
+    const std::string &mountedDisk(void) const { return diskName; }
+
+    // Latency and I/O counters of this instance, see fs_metrics()
+    Metrics &metrics(void) { return counters; }
+
+private:
+    FileSystem(const FileSystem &);
+    FileSystem &operator=(const FileSystem &);
+
+    // Inode of name in the current directory, -1 if there is none
+    int inodeSearch(char name[5]);
+
+    // Mark data blocks [start, end) as used or free
+    void useBlocks(int start, int end);
+    void freeBlocks(int start, int end);
+
+    // Zeroing of freed blocks and the deferred zero queue
+    void takeQueued(uint32_t start, uint32_t end, std::vector<std::pair<uint32_t, uint32_t>> &ranges);
+    void zeroBlocks(uint32_t start, uint32_t end);
+    void zeroQueued(uint32_t start, uint32_t end);
+    void drainQueued(void);
+    void reclaimBlocks(uint32_t start, uint32_t end);
+
+    // Write the cached data blocks and the superblock changes, updateSB() unless a batch is open
+    void writeback(void);
+    void updateSB(void);
+
+    // Write back everything, flush() without the lock
+    void sync(void);
+
+    // Snapshot of the mounted disk for its next mount, when snapshots are on
+    void saveSnapshot(void);
+
+    // printf to the output stream, one line of up to 63 characters
+    void print(const char *format, ...);
+
+    // File inode for a run of blocks, -1 after printing the error. Its lock is taken into guard.
+    int rangeInode(char name[5], int block_num, int count, bool exclusive, RWGuard &guard);
+    bool validSlot(int slot);
+
+    static const size_t INODE_LOCKS = 64;
+    RWLock &inodeLock(int inode) { return inodeLocks[(uint32_t)inode % INODE_LOCKS]; }
+
+    Disk *disk;                  // Mounted disk
+    bool mapDisk;                // Mount disks with mmap
+    bool snapshots;              // Save and load mount snapshots
+    uint32_t currDirectory;      // Current working directory
+    std::string diskName;        // Mounted disk name
+    bool mounted;                // Mounted checker
+    bool batch;                  // Superblock writeback waits for batchEnd()
+    bool deferZero;              // Freed blocks are zeroed lazily
+    bool concurrent;             // Thread-safe execution mode, the block cache is off
+    size_t cacheCapacity;        // Block cache capacity to restore after the concurrent mode
+    std::ostream *out;           // Listings
+    std::ostream *err;           // Error messages
+
+    FS_super_block *superBlock;  // Super_block
+    FreeExtents freeExtents;     // Free extents of the mounted disk
+    BufferPool buffers;          // Buffer slots, slot 0 is the buffer of buff/read/write
+    BlockCache blockCache;       // Data blocks of the mounted disk
+    DirIndex fileTree;           // Directory index of the mounted disk
+    Metrics counters;            // Latency and I/O counters, kept across mounts
+
+    std::map<uint32_t, uint32_t> zeroQueue; // Freed ranges [start, end) not zeroed yet, by start
+
+    ShardedRWLock dirLock;           // Directory index, inode table and current directory, sharded for the readers
+    RWLock inodeLocks[INODE_LOCKS];  // Size, place and data of the inodes, by inode % INODE_LOCKS
+    std::mutex spaceLock;            // Free-space list, free extents, zero queue and superblock writeback
+};
+
+/**
+ * The instance the fs_* functions run on
+ */
+FileSystem &fs_default(void);
+
+#endif
@@ -0,0 +1,299 @@
+#include "FreeExtents.h"
+
+using namespace std;
+
+FreeExtents::FreeExtents() : root(-1), seed(2463534242u)
+{
+}
+
+void FreeExtents::clear()
+{
+    nodes.clear();
+    unused.clear();
+    by_length.clear();
+    root = -1;
+}
+
+void FreeExtents::build(const BlockBitmap &free_blocks, size_t first)
+{
+    clear();
+
+    size_t length = 0;
+    size_t start = free_blocks.nextRun(first, length);
+    while (start < free_blocks.size())
+    {
+        insert(start, length);
+        start = free_blocks.nextRun(start + length, length);
+    }
+}
+
+void FreeExtents::assign(const vector<pair<size_t, size_t>> &extents)
+{
+    clear();
+    for (size_t i = 0; i < extents.size(); i++)
+    {
+        insert(extents[i].first, extents[i].second);
+    }
+}
+
+int FreeExtents::newNode(size_t start, size_t length)
+{
+    // xorshift32, the tree shape only depends on the order of operations
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    Node node = {start, length, length, seed, -1, -1};
+    if (!unused.empty())
+    {
+        int index = unused.back();
+        unused.pop_back();
+        nodes[index] = node;
+        return index;
+    }
+    nodes.push_back(node);
+    return (int)nodes.size() - 1;
+}
+
+void FreeExtents::update(int node)
+{
+    Node &n = nodes[node];
+    n.longest = n.length;
+    if (n.left >= 0 && nodes[n.left].longest > n.longest)
+    {
+        n.longest = nodes[n.left].longest;
+    }
+    if (n.right >= 0 && nodes[n.right].longest > n.longest)
+    {
+        n.longest = nodes[n.right].longest;
+    }
+}
+
+// left gets every node with a start below start, right gets the rest
+void FreeExtents::split(int node, size_t start, int &left, int &right)
+{
+    if (node < 0)
+    {
+        left = right = -1;
+        return;
+    }
+    if (nodes[node].start < start)
+    {
+        split(nodes[node].right, start, nodes[node].right, right);
+        left = node;
+    }
+    else
+    {
+        split(nodes[node].left, start, left, nodes[node].left);
+        right = node;
+    }
+    update(node);
+}
+
+int FreeExtents::merge(int left, int right)
+{
+    if (left < 0)
+    {
+        return right;
+    }
+    if (right < 0)
+    {
+        return left;
+    }
+    if (nodes[left].priority > nodes[right].priority)
+    {
+        nodes[left].right = merge(nodes[left].right, right);
+        update(left);
+        return left;
+    }
+    nodes[right].left = merge(left, nodes[right].left);
+    update(right);
+    return right;
+}
+
+void FreeExtents::insert(size_t start, size_t length)
+{
+    int left, right;
+    split(root, start, left, right);
+    root = merge(merge(left, newNode(start, length)), right);
+    by_length.insert(make_pair(length, start));
+}
+
+void FreeExtents::erase(size_t start)
+{
+    int left, middle, right;
+    split(root, start, left, middle);
+    split(middle, start + 1, middle, right);
+    if (middle >= 0)
+    {
+        by_length.erase(make_pair(nodes[middle].length, nodes[middle].start));
+        unused.push_back(middle);
+    }
+    root = merge(left, right);
+}
+
+int FreeExtents::floor(size_t start) const
+{
+    int node = root;
+    int found = -1;
+    while (node >= 0)
+    {
+        if (nodes[node].start <= start)
+        {
+            found = node;
+            node = nodes[node].right;
+        }
+        else
+        {
+            node = nodes[node].left;
+        }
+    }
+    return found;
+}
+
+int FreeExtents::ceiling(size_t start) const
+{
+    int node = root;
+    int found = -1;
+    while (node >= 0)
+    {
+        if (nodes[node].start >= start)
+        {
+            found = node;
+            node = nodes[node].left;
+        }
+        else
+        {
+            node = nodes[node].right;
+        }
+    }
+    return found;
+}
+
+bool FreeExtents::allocate(size_t start, size_t size)
+{
+    if (size == 0)
+    {
+        return true;
+    }
+
+    int node = floor(start);
+    if (node < 0 || nodes[node].start + nodes[node].length < start + size)
+    {
+        // Not free
+        return false;
+    }
+
+    size_t extent_start = nodes[node].start;
+    size_t extent_end = extent_start + nodes[node].length;
+    erase(extent_start);
+
+    // Keep whatever is left on either side
+    if (extent_start < start)
+    {
+        insert(extent_start, start - extent_start);
+    }
+    if (start + size < extent_end)
+    {
+        insert(start + size, extent_end - start - size);
+    }
+    return true;
+}
+
+void FreeExtents::release(size_t start, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    size_t end = start + size;
+
+    // Merge with the extent ending right before start
+    int before = floor(start);
+    if (before >= 0 && nodes[before].start + nodes[before].length == start)
+    {
+        start = nodes[before].start;
+        erase(start);
+    }
+
+    // Merge with the extent starting right after end
+    int after = ceiling(end);
+    if (after >= 0 && nodes[after].start == end)
+    {
+        end += nodes[after].length;
+        erase(nodes[after].start);
+    }
+
+    insert(start, end - start);
+}
+
+long FreeExtents::firstFit(size_t size) const
+{
+    int node = root;
+    if (node < 0 || nodes[node].longest < size)
+    {
+        return -1;
+    }
+
+    // Go left whenever the left subtree has a big enough extent
+    for (;;)
+    {
+        const Node &n = nodes[node];
+        if (n.left >= 0 && nodes[n.left].longest >= size)
+        {
+            node = n.left;
+        }
+        else if (n.length >= size)
+        {
+            return (long)n.start;
+        }
+        else
+        {
+            node = n.right;
+        }
+    }
+}
+
+long FreeExtents::bestFit(size_t size) const
+{
+    set<pair<size_t, size_t>>::const_iterator it = by_length.lower_bound(make_pair(size, (size_t)0));
+    if (it == by_length.end())
+    {
+        return -1;
+    }
+    return (long)it->second;
+}
+
+size_t FreeExtents::extentAt(size_t start) const
+{
+    int node = floor(start);
+    if (node < 0 || nodes[node].start != start)
+    {
+        return 0;
+    }
+    return nodes[node].length;
+}
+
+vector<pair<size_t, size_t>> FreeExtents::list() const
+{
+    vector<pair<size_t, size_t>> extents;
+    extents.reserve(by_length.size());
+
+    // In-order walk without recursion
+    vector<int> stack;
+    int node = root;
+    while (node >= 0 || !stack.empty())
+    {
+        while (node >= 0)
+        {
+            stack.push_back(node);
+            node = nodes[node].left;
+        }
+        node = stack.back();
+        stack.pop_back();
+        extents.push_back(make_pair(nodes[node].start, nodes[node].length));
+        node = nodes[node].right;
+    }
+    return extents;
+}
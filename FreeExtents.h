@@ -0,0 +1,89 @@
+#ifndef FREE_EXTENTS_H
+#define FREE_EXTENTS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "BlockBitmap.h"
+
+/**
+ * Index of the free extents (runs of free data blocks) of the mounted disk.
+ *
+ * Extents are kept in a treap ordered by start block where every node also
+ * stores the longest extent in its subtree, so the first-fit extent is found
+ * in O(log n). A second set orders the extents by (length, start) for
+ * best-fit. Both are updated in place on every allocate and release, equal
+ * sized extents are never merged or dropped.
+ */
+class FreeExtents
+{
+public:
+    FreeExtents();
+
+    // Drop every extent
+    void clear();
+
+    // Rebuild from the free-space bitmap, blocks before first are not indexed
+    void build(const BlockBitmap &free_blocks, size_t first);
+
+    // Rebuild from (start, length) extents in start order that do not touch
+    void assign(const std::vector<std::pair<size_t, size_t>> &extents);
+
+    // Marks [start, start + size) as used, the range must be inside one free extent
+    bool allocate(size_t start, size_t size);
+
+    // Marks [start, start + size) as free and merges it with its neighbours
+    void release(size_t start, size_t size);
+
+    // Start of the lowest extent with at least size blocks, -1 if there is none
+    long firstFit(size_t size) const;
+
+    // Start of the smallest extent with at least size blocks, -1 if there is none
+    long bestFit(size_t size) const;
+
+    // Length of the free extent that starts at start, 0 if none starts there
+    size_t extentAt(size_t start) const;
+
+    // Number of free extents
+    size_t count() const { return by_length.size(); }
+
+    // Extents as (start, length) pairs in start order
+    std::vector<std::pair<size_t, size_t>> list() const;
+
+private:
+    struct Node
+    {
+        size_t start;
+        size_t length;
+        size_t longest; // Longest extent in this subtree
+        uint32_t priority;
+        int left;
+        int right;
+    };
+
+    int newNode(size_t start, size_t length);
+    void update(int node);
+    void split(int node, size_t start, int &left, int &right);
+    int merge(int left, int right);
+    void insert(size_t start, size_t length);
+    void erase(size_t start);
+
+    // Node with the largest start <= start, -1 if there is none
+    int floor(size_t start) const;
+
+    // Node with the smallest start >= start, -1 if there is none
+    int ceiling(size_t start) const;
+
+    std::vector<Node> nodes;
+    std::vector<int> unused; // Recycled node slots
+    int root;
+    uint32_t seed;
+
+    // (length, start) of every extent
+    std::set<std::pair<size_t, size_t>> by_length;
+};
+
+#endif
@@ -0,0 +1,321 @@
+#include <chrono>
+#include <cstdio>
+
+#include "Metrics.h"
+
+using namespace std;
+
+static const char *OP_NAMES[Metrics::OPS] = {
+    "mount", "create", "delete", "read", "write", "read_range", "write_range", "buff", "ls", "resize", "defrag",
+    "defrag_start", "defrag_step", "defrag_dry_run", "cd", "unmount", "flush", "batch_begin", "batch_end",
+};
+
+static const char *SITE_NAMES[Metrics::SITES] = {"other", "read", "write", "superblock", "move", "zero", "cache"};
+
+static const char *KIND_NAMES[Metrics::KINDS] = {"read", "write", "copy", "zero", "sync"};
+
+thread_local Metrics::SiteId Metrics::current = Metrics::SITE_OTHER;
+thread_local int Metrics::threadShard = -1;
+
+void Histogram::add(uint64_t ns, uint64_t length)
+{
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= BUCKETS)
+    {
+        bucket = BUCKETS - 1;
+    }
+    calls.fetch_add(1, memory_order_relaxed);
+    bytes.fetch_add(length, memory_order_relaxed);
+    total.fetch_add(ns, memory_order_relaxed);
+    buckets[bucket].fetch_add(1, memory_order_relaxed);
+
+    uint64_t longest = max.load(memory_order_relaxed);
+    while (ns > longest && !max.compare_exchange_weak(longest, ns, memory_order_relaxed))
+    {
+    }
+}
+
+void Histogram::add(const Snapshot &snapshot)
+{
+    calls.fetch_add(snapshot.calls, memory_order_relaxed);
+    bytes.fetch_add(snapshot.bytes, memory_order_relaxed);
+    total.fetch_add(snapshot.total, memory_order_relaxed);
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        buckets[i].fetch_add(snapshot.buckets[i], memory_order_relaxed);
+    }
+
+    uint64_t longest = max.load(memory_order_relaxed);
+    while (snapshot.max > longest && !max.compare_exchange_weak(longest, snapshot.max, memory_order_relaxed))
+    {
+    }
+}
+
+void Histogram::snapshot(Snapshot &snapshot) const
+{
+    snapshot.calls = calls.load(memory_order_relaxed);
+    snapshot.bytes = bytes.load(memory_order_relaxed);
+    snapshot.total = total.load(memory_order_relaxed);
+    snapshot.max = max.load(memory_order_relaxed);
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        snapshot.buckets[i] = buckets[i].load(memory_order_relaxed);
+    }
+}
+
+void Histogram::reset()
+{
+    calls.store(0, memory_order_relaxed);
+    bytes.store(0, memory_order_relaxed);
+    total.store(0, memory_order_relaxed);
+    max.store(0, memory_order_relaxed);
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        buckets[i].store(0, memory_order_relaxed);
+    }
+}
+
+uint64_t Histogram::Snapshot::percentile(double fraction) const
+{
+    // Counted one by one, the buckets may not add up to calls while other threads add
+    uint64_t count = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        count += buckets[i];
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (count > 0 && seen >= fraction * count)
+        {
+            uint64_t bound = i == 0 ? 0 : (1ull << i) - 1;
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+void Histogram::Snapshot::add(const Snapshot &other)
+{
+    calls += other.calls;
+    bytes += other.bytes;
+    total += other.total;
+    max = max > other.max ? max : other.max;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        buckets[i] += other.buckets[i];
+    }
+}
+
+int Metrics::nextShard()
+{
+    static atomic<unsigned> threads(0);
+    return (int)(threads.fetch_add(1, memory_order_relaxed) % SHARDS);
+}
+
+void Metrics::opSnapshot(int op, Histogram::Snapshot &snapshot) const
+{
+    Histogram::Snapshot shard;
+    shards[0].ops[op].snapshot(snapshot);
+    for (int i = 1; i < SHARDS; i++)
+    {
+        shards[i].ops[op].snapshot(shard);
+        snapshot.add(shard);
+    }
+}
+
+void Metrics::ioSnapshot(int site, int kind, Histogram::Snapshot &snapshot) const
+{
+    Histogram::Snapshot shard;
+    shards[0].ios[site][kind].snapshot(snapshot);
+    for (int i = 1; i < SHARDS; i++)
+    {
+        shards[i].ios[site][kind].snapshot(shard);
+        snapshot.add(shard);
+    }
+}
+
+uint64_t Metrics::now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Metrics::add(const Metrics &other)
+{
+    Shard &mine = shard();
+    Histogram::Snapshot snapshot;
+    for (int op = 0; op < OPS; op++)
+    {
+        other.opSnapshot(op, snapshot);
+        mine.ops[op].add(snapshot);
+    }
+    for (int site = 0; site < SITES; site++)
+    {
+        for (int kind = 0; kind < KINDS; kind++)
+        {
+            other.ioSnapshot(site, kind, snapshot);
+            mine.ios[site][kind].add(snapshot);
+        }
+    }
+    for (int i = 0; i < SHARDS; i++)
+    {
+        mine.requestedBytes.fetch_add(other.shards[i].requestedBytes.load(memory_order_relaxed), memory_order_relaxed);
+    }
+}
+
+void Metrics::reset()
+{
+    for (int i = 0; i < SHARDS; i++)
+    {
+        Shard &shard = shards[i];
+        for (int op = 0; op < OPS; op++)
+        {
+            shard.ops[op].reset();
+        }
+        for (int site = 0; site < SITES; site++)
+        {
+            for (int kind = 0; kind < KINDS; kind++)
+            {
+                shard.ios[site][kind].reset();
+            }
+        }
+        shard.requestedBytes.store(0, memory_order_relaxed);
+    }
+}
+
+// One JSON object of a histogram, the buckets as [upper bound in ns, calls] pairs
+static void printJSON(ostream &out, const Histogram::Snapshot &h, bool bytes)
+{
+    out << "{\"calls\": " << h.calls;
+    if (bytes)
+    {
+        out << ", \"bytes\": " << h.bytes;
+    }
+    out << ", \"total_ns\": " << h.total << ", \"max_ns\": " << h.max << ", \"p50_ns\": " << h.percentile(0.5)
+        << ", \"p99_ns\": " << h.percentile(0.99) << ", \"buckets\": [";
+    bool first = true;
+    for (int i = 0; i < Histogram::BUCKETS; i++)
+    {
+        if (h.buckets[i] > 0)
+        {
+            out << (first ? "" : ", ") << "[" << (i == 0 ? 0 : (1ull << i) - 1) << ", " << h.buckets[i] << "]";
+            first = false;
+        }
+    }
+    out << "]}";
+}
+
+void Metrics::print(ostream &out, bool json) const
+{
+    Histogram::Snapshot h;
+    char line[128];
+
+    // Every byte that reached the image, whoever wrote it
+    uint64_t written = 0;
+    for (int site = 0; site < SITES; site++)
+    {
+        for (int kind = IO_WRITE; kind <= IO_ZERO; kind++)
+        {
+            ioSnapshot(site, kind, h);
+            written += h.bytes;
+        }
+    }
+    uint64_t requested = 0;
+    for (int i = 0; i < SHARDS; i++)
+    {
+        requested += shards[i].requestedBytes.load(memory_order_relaxed);
+    }
+    double amplification = requested == 0 ? 0 : (double)written / requested;
+
+    if (json)
+    {
+        out << "{\"operations\": {";
+        bool first = true;
+        for (int op = 0; op < OPS; op++)
+        {
+            opSnapshot(op, h);
+            if (h.calls > 0)
+            {
+                out << (first ? "" : ", ") << "\"" << OP_NAMES[op] << "\": ";
+                printJSON(out, h, false);
+                first = false;
+            }
+        }
+        out << "}, \"io\": {";
+        first = true;
+        for (int site = 0; site < SITES; site++)
+        {
+            bool firstKind = true;
+            for (int kind = 0; kind < KINDS; kind++)
+            {
+                ioSnapshot(site, kind, h);
+                if (h.calls == 0)
+                {
+                    continue;
+                }
+                if (firstKind)
+                {
+                    out << (first ? "" : ", ") << "\"" << SITE_NAMES[site] << "\": {";
+                    first = false;
+                }
+                out << (firstKind ? "" : ", ") << "\"" << KIND_NAMES[kind] << "\": ";
+                printJSON(out, h, true);
+                firstKind = false;
+            }
+            if (!firstKind)
+            {
+                out << "}";
+            }
+        }
+        snprintf(line, sizeof(line), "%.3f", amplification);
+        out << "}, \"write_amplification\": {\"requested_bytes\": " << requested << ", \"written_bytes\": " << written
+            << ", \"ratio\": " << line << "}}" << endl;
+        return;
+    }
+
+    snprintf(line, sizeof(line), "%-15s %9s %11s %10s %10s %10s %10s\n", "Operation", "Calls", "Total ms", "Mean us",
+             "p50 us", "p99 us", "Max us");
+    out << line;
+    for (int op = 0; op < OPS; op++)
+    {
+        opSnapshot(op, h);
+        if (h.calls > 0)
+        {
+            snprintf(line, sizeof(line), "%-15s %9llu %11.3f %10.2f %10.2f %10.2f %10.2f\n", OP_NAMES[op],
+                     (unsigned long long)h.calls, h.total / 1e6, h.total / 1e3 / h.calls, h.percentile(0.5) / 1e3,
+                     h.percentile(0.99) / 1e3, h.max / 1e3);
+            out << line;
+        }
+    }
+
+    snprintf(line, sizeof(line), "%-10s %-5s %9s %13s %11s %10s %10s\n", "Site", "Call", "Calls", "Bytes", "Total ms",
+             "Mean us", "Max us");
+    out << line;
+    for (int site = 0; site < SITES; site++)
+    {
+        for (int kind = 0; kind < KINDS; kind++)
+        {
+            ioSnapshot(site, kind, h);
+            if (h.calls > 0)
+            {
+                snprintf(line, sizeof(line), "%-10s %-5s %9llu %13llu %11.3f %10.2f %10.2f\n", SITE_NAMES[site],
+                         KIND_NAMES[kind], (unsigned long long)h.calls, (unsigned long long)h.bytes, h.total / 1e6,
+                         h.total / 1e3 / h.calls, h.max / 1e3);
+                out << line;
+            }
+        }
+    }
+
+    if (requested == 0)
+    {
+        snprintf(line, sizeof(line), "Write amplification: - (%llu bytes written, no writes requested)\n",
+                 (unsigned long long)written);
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "Write amplification: %.3f (%llu bytes written for %llu bytes requested)\n",
+                 amplification, (unsigned long long)written, (unsigned long long)requested);
+    }
+    out << line;
+}
@@ -0,0 +1,163 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+/**
+ * Latency histogram: a call count, a byte count and the total and largest time, with
+ * the calls in log2 buckets of nanoseconds (bucket i holds [2^(i-1), 2^i), the last
+ * one everything longer). Every counter is a relaxed atomic, so any thread may add.
+ */
+class Histogram
+{
+public:
+    static const int BUCKETS = 40;
+
+    struct Snapshot
+    {
+        uint64_t calls;
+        uint64_t bytes;
+        uint64_t total; // ns
+        uint64_t max;   // ns
+        uint64_t buckets[BUCKETS];
+
+        // Upper bound in ns of the bucket holding the given fraction of the calls, at most max
+        uint64_t percentile(double fraction) const;
+
+        // Adds the counts of other, as if its calls were made here
+        void add(const Snapshot &other);
+    };
+
+    Histogram() { reset(); }
+
+    void add(uint64_t ns, uint64_t bytes);
+    // Adds the counts of a snapshot, as if its calls were made here
+    void add(const Snapshot &snapshot);
+    void snapshot(Snapshot &snapshot) const;
+    void reset();
+
+private:
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max;
+    std::atomic<uint64_t> buckets[BUCKETS];
+};
+
+/**
+ * Counters of one file system: the latency of every entry point, and the count, bytes
+ * and time of every disk call by the site that issued it. The site is set per thread
+ * with a Metrics::Site scope around the code that reaches the disk; calls outside any
+ * scope count as "other". Always on, a command costs two clock reads and a few relaxed
+ * atomic additions. The counters are kept in SHARDS copies and every thread adds to the
+ * one it is given on its first count, so threads of the concurrent mode do not share
+ * cache lines for them unless there are more threads than copies. print() and reset()
+ * go over every copy.
+ */
+class Metrics
+{
+public:
+    enum Op
+    {
+        MOUNT, CREATE, DELETE, READ, WRITE, READ_RANGE, WRITE_RANGE, BUFF, LS, RESIZE, DEFRAG,
+        DEFRAG_START, DEFRAG_STEP, DEFRAG_DRY_RUN, CD, UNMOUNT, FLUSH, BATCH_BEGIN, BATCH_END, OPS
+    };
+
+    // Who issued a disk call: block reads and writes of files, superblock writeback, file
+    // moves, zeroing of freed blocks and write back of the block cache
+    enum SiteId
+    {
+        SITE_OTHER, SITE_READ, SITE_WRITE, SITE_SUPERBLOCK, SITE_MOVE, SITE_ZERO, SITE_CACHE, SITES
+    };
+
+    // Kind of disk call: pread (or memcpy from a mapping), pwrite, copy_file_range, fallocate, msync
+    enum Kind
+    {
+        IO_READ, IO_WRITE, IO_COPY, IO_ZERO, IO_SYNC, KINDS
+    };
+
+    // Sets the site of the disk calls of this thread until the scope ends
+    class Site
+    {
+    public:
+        explicit Site(SiteId site) : previous(current) { current = site; }
+        ~Site() { current = previous; }
+
+    private:
+        Site(const Site &);
+        Site &operator=(const Site &);
+
+        SiteId previous;
+    };
+
+    // Adds the time from its construction to the histogram of op
+    class Timer
+    {
+    public:
+        Timer(Metrics &metrics, Op op) : histogram(metrics.shard().ops[op]), start(now()) {}
+        ~Timer() { histogram.add(now() - start, 0); }
+
+    private:
+        Timer(const Timer &);
+        Timer &operator=(const Timer &);
+
+        Histogram &histogram;
+        uint64_t start;
+    };
+
+    // Monotonic clock in ns
+    static uint64_t now();
+
+    // Counts a disk call of kind on length bytes that took ns, under the current site
+    void io(Kind kind, uint64_t ns, size_t length) { shard().ios[current][kind].add(ns, length); }
+
+    // Counts bytes of data the user asked to write, for the write amplification
+    void requested(uint64_t bytes) { shard().requestedBytes.fetch_add(bytes, std::memory_order_relaxed); }
+
+    // Adds everything other counted so far, as if its commands ran here
+    void add(const Metrics &other);
+
+    // Text table or JSON object of everything counted so far
+    void print(std::ostream &out, bool json) const;
+
+    void reset();
+
+private:
+    static const int SHARDS = 16;
+
+    // One copy of the counters
+    struct Shard
+    {
+        Histogram ops[OPS];
+        Histogram ios[SITES][KINDS];
+        std::atomic<uint64_t> requestedBytes{0};
+        char padding[64]; // The next copy starts on a cache line of its own
+    };
+
+    // Copy of the counters this thread adds to
+    Shard &shard()
+    {
+        if (threadShard < 0)
+        {
+            threadShard = nextShard();
+        }
+        return shards[threadShard];
+    }
+
+    // Copy for a thread that counts for the first time, round robin
+    static int nextShard();
+
+    // Sums of every copy
+    void opSnapshot(int op, Histogram::Snapshot &snapshot) const;
+    void ioSnapshot(int site, int kind, Histogram::Snapshot &snapshot) const;
+
+    static thread_local SiteId current;
+    static thread_local int threadShard;
+
+    Shard shards[SHARDS];
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include <vector>
+
+#include "MountTable.h"
+
+using namespace std;
+
+MountTable::~MountTable()
+{
+    for (map<string, FileSystem *>::iterator it = disks.begin(); it != disks.end(); ++it)
+    {
+        delete it->second;
+    }
+}
+
+FileSystem *MountTable::open(const string &disk, bool mapped)
+{
+    lock_guard<mutex> guard(lock);
+    map<string, FileSystem *>::iterator it = disks.find(disk);
+    if (it != disks.end())
+    {
+        return it->second;
+    }
+
+    FileSystem *fs = new FileSystem();
+    fs->setMountMmap(mapped);
+    vector<char> name(disk.begin(), disk.end());
+    name.push_back('\0');
+    fs->mount(name.data());
+    if (!fs->isMounted())
+    {
+        delete fs;
+        return nullptr;
+    }
+    disks[disk] = fs;
+    return fs;
+}
+
+FileSystem *MountTable::find(const string &disk)
+{
+    lock_guard<mutex> guard(lock);
+    map<string, FileSystem *>::iterator it = disks.find(disk);
+    return it == disks.end() ? nullptr : it->second;
+}
+
+bool MountTable::close(const string &disk)
+{
+    FileSystem *fs;
+    {
+        lock_guard<mutex> guard(lock);
+        map<string, FileSystem *>::iterator it = disks.find(disk);
+        if (it == disks.end())
+        {
+            return false;
+        }
+        fs = it->second;
+        disks.erase(it);
+    }
+    // The writeback runs outside the lock
+    delete fs;
+    return true;
+}
+
+size_t MountTable::size()
+{
+    lock_guard<mutex> guard(lock);
+    return disks.size();
+}
@@ -0,0 +1,46 @@
+#ifndef MOUNT_TABLE_H
+#define MOUNT_TABLE_H
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "FileSystem.h"
+
+/**
+ * Disk images mounted at the same time, one FileSystem instance each, keyed
+ * by the disk name as it was given to open().
+ *
+ * The table itself is locked, so threads can open, find and close disks
+ * concurrently. Commands on one instance follow its own rules: one thread at a
+ * time, unless FileSystem::setConcurrent is on for it.
+ */
+class MountTable
+{
+public:
+    MountTable() {}
+    // Writes back and unmounts every disk
+    ~MountTable();
+
+    // Instance with disk mounted, mounted (with mmap when mapped is set) on the
+    // first call. nullptr, after the mount error, if the disk cannot be mounted.
+    FileSystem *open(const std::string &disk, bool mapped = false);
+
+    // Instance of an open disk, nullptr if it is not open
+    FileSystem *find(const std::string &disk);
+
+    // Writes back and unmounts disk, false if it is not open
+    bool close(const std::string &disk);
+
+    size_t size();
+
+private:
+    MountTable(const MountTable &);
+    MountTable &operator=(const MountTable &);
+
+    std::mutex lock;
+    std::map<std::string, FileSystem *> disks;
+};
+
+#endif
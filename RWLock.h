@@ -0,0 +1,137 @@
+#ifndef RW_LOCK_H
+#define RW_LOCK_H
+
+#include <atomic>
+#include <pthread.h>
+
+/**
+ * Reader/writer lock: any number of shared holders or one exclusive holder.
+ * C++11 has no shared mutex, this wraps pthread_rwlock_t.
+ */
+class RWLock
+{
+public:
+    RWLock() { pthread_rwlock_init(&lock, nullptr); }
+    ~RWLock() { pthread_rwlock_destroy(&lock); }
+
+    void lockShared() { pthread_rwlock_rdlock(&lock); }
+    void lockExclusive() { pthread_rwlock_wrlock(&lock); }
+    void unlock() { pthread_rwlock_unlock(&lock); }
+
+private:
+    RWLock(const RWLock &);
+    RWLock &operator=(const RWLock &);
+
+    pthread_rwlock_t lock;
+};
+
+/**
+ * Reader/writer lock that nearly every call takes shared: one RWLock per shard, each on
+ * cache lines of its own. A shared holder locks the shard of its thread (given round
+ * robin on its first lock), so readers on different cores do not write the same line.
+ * An exclusive holder locks every shard in order, which costs SHARDS locks.
+ */
+class ShardedRWLock
+{
+public:
+    static const int SHARDS = 16;
+
+    ShardedRWLock() : exclusive(false) {}
+
+    void lockShared() { shards[shard()].lock.lockShared(); }
+
+    void lockExclusive()
+    {
+        for (int i = 0; i < SHARDS; i++)
+        {
+            shards[i].lock.lockExclusive();
+        }
+        exclusive = true;
+    }
+
+    // Only the holder reads exclusive: a shared holder keeps every writer out
+    void unlock()
+    {
+        if (!exclusive)
+        {
+            shards[shard()].lock.unlock();
+            return;
+        }
+        exclusive = false;
+        for (int i = SHARDS - 1; i >= 0; i--)
+        {
+            shards[i].lock.unlock();
+        }
+    }
+
+private:
+    ShardedRWLock(const ShardedRWLock &);
+    ShardedRWLock &operator=(const ShardedRWLock &);
+
+    struct Shard
+    {
+        RWLock lock;
+        char padding[64]; // No two locks share a cache line
+    };
+
+    static int shard()
+    {
+        static std::atomic<unsigned> threads(0);
+        static thread_local int index = -1;
+        if (index < 0)
+        {
+            index = (int)(threads.fetch_add(1, std::memory_order_relaxed) % SHARDS);
+        }
+        return index;
+    }
+
+    Shard shards[SHARDS];
+    bool exclusive;
+};
+
+/**
+ * Holds a lock (RWLock or ShardedRWLock) until it goes out of scope. A guard made
+ * without a lock takes one later with acquire().
+ */
+template <class Lock>
+class BasicRWGuard
+{
+public:
+    BasicRWGuard() : held(nullptr) {}
+    BasicRWGuard(Lock &lock, bool exclusive) : held(nullptr) { acquire(lock, exclusive); }
+    ~BasicRWGuard() { release(); }
+
+    void acquire(Lock &lock, bool exclusive)
+    {
+        release();
+        if (exclusive)
+        {
+            lock.lockExclusive();
+        }
+        else
+        {
+            lock.lockShared();
+        }
+        held = &lock;
+    }
+
+    void release()
+    {
+        if (held != nullptr)
+        {
+            held->unlock();
+            held = nullptr;
+        }
+    }
+
+private:
+    BasicRWGuard(const BasicRWGuard &);
+    BasicRWGuard &operator=(const BasicRWGuard &);
+
+    Lock *held;
+};
+
+typedef BasicRWGuard<RWLock> RWGuard;
+typedef BasicRWGuard<ShardedRWLock> ShardedRWGuard;
+
+#endif
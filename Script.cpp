@@ -0,0 +1,528 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <vector>
+
+#include "Script.h"
+#include "Timeline.h"
+#include "Trace.h"
+
+using namespace std;
+
+// Bytes read from the script at a time, a longer line grows the buffer
+static const size_t CHUNK = 1 << 16;
+
+// Tokens of a line that are kept, no command has more arguments. A line may have
+// more, they are counted so the argument checks still see them.
+static const size_t MAX_TOKENS = 4;
+
+// A space separated word of a line, in place in the read buffer
+struct Token
+{
+    char *data;
+    size_t size;
+};
+
+// One script line being parsed
+struct Line
+{
+    char *text;  // Whole line without the newline, NUL-terminated
+    size_t size; // Bytes in text, NULs included
+    Token tokens[MAX_TOKENS];
+    size_t count; // Tokens on the line, may be more than MAX_TOKENS
+};
+
+// Command parser, false if the line is a command error
+typedef bool (*Handler)(Line &line, Command &command);
+
+// Splits the line on ' ' like tokenize, up to the first NUL. Nothing is copied.
+static void split(Line &line)
+{
+    char *at = line.text;
+    char *end = line.text + strnlen(line.text, line.size);
+    line.count = 0;
+    while (at < end)
+    {
+        if (*at == ' ')
+        {
+            at++;
+            continue;
+        }
+        char *word = at;
+        while (at < end && *at != ' ')
+        {
+            at++;
+        }
+        if (line.count < MAX_TOKENS)
+        {
+            line.tokens[line.count].data = word;
+            line.tokens[line.count].size = at - word;
+        }
+        line.count++;
+    }
+}
+
+// NUL-terminates the kept tokens in place, the byte after each is a space or the end of the line
+static void terminate(Line &line)
+{
+    for (size_t i = 0; i < line.count && i < MAX_TOKENS; i++)
+    {
+        line.tokens[i].data[line.tokens[i].size] = '\0';
+    }
+}
+
+// Integer argument, atoi on the terminated token so the checks accept what they always did
+static int number(const Token &token)
+{
+    return atoi(token.data);
+}
+
+static void setText(Command &command, const Token &token)
+{
+    command.text = token.data;
+    command.size = token.size;
+}
+
+// Buffer slot of a B, R or W command: "W" is slot 0 and "W:3" slot 3. -1 if the slot does not exist.
+static int slotOf(const Token &command)
+{
+    if (command.size < 2 || command.data[1] != ':')
+    {
+        return 0;
+    }
+    if (command.size == 2 || command.size > 4)
+    {
+        return -1;
+    }
+    int slot = 0;
+    for (size_t i = 2; i < command.size; i++)
+    {
+        if (command.data[i] < '0' || command.data[i] > '9')
+        {
+            return -1;
+        }
+        slot = slot * 10 + (command.data[i] - '0');
+    }
+    return slot < FS_BUFFER_SLOTS ? slot : -1;
+}
+
+static bool parseMount(Line &line, Command &command)
+{
+    if (line.count != 2)
+    {
+        return false;
+    }
+    command.op = Command::MOUNT;
+    setText(command, line.tokens[1]);
+    return true;
+}
+
+static bool parseCreate(Line &line, Command &command)
+{
+    if (line.count != 3)
+    {
+        return false;
+    }
+    command.op = Command::CREATE;
+    command.a = number(line.tokens[2]);
+    setText(command, line.tokens[1]);
+    return true;
+}
+
+static bool parseDelete(Line &line, Command &command)
+{
+    if (line.count != 2)
+    {
+        return false;
+    }
+    command.op = Command::DELETE;
+    setText(command, line.tokens[1]);
+    return true;
+}
+
+// R and W: <name> <block>, or <name> <block> <count> for a run of blocks
+static bool parseBlocks(Line &line, Command &command)
+{
+    command.slot = slotOf(line.tokens[0]);
+    if (command.slot < 0 || line.count < 3 || line.count > 4)
+    {
+        return false;
+    }
+    command.a = number(line.tokens[2]);
+    command.b = line.count == 4 ? number(line.tokens[3]) : 1;
+    command.op = line.text[0] == 'R' ? Command::READ : Command::WRITE;
+    setText(command, line.tokens[1]);
+    return true;
+}
+
+static bool parseBuff(Line &line, Command &command)
+{
+    if (line.count == 1)
+    {
+        return false;
+    }
+    command.slot = slotOf(line.tokens[0]);
+    if (command.slot < 0)
+    {
+        return false;
+    }
+    // Skip the command, B or B:<slot>, the rest of the line is the text
+    char *text = line.text + (line.size >= 2 && line.text[1] == ':' ? line.tokens[0].size : 1);
+    while (*text == ' ')
+    {
+        text++;
+    }
+    size_t size = line.size - (text - line.text);
+    if (size > 1024)
+    {
+        return false;
+    }
+    // The slot takes the text up to its first NUL
+    command.op = Command::BUFF;
+    command.text = text;
+    command.size = strnlen(text, size);
+    return true;
+}
+
+static bool parseLs(Line &line, Command &command)
+{
+    if (line.count > 1)
+    {
+        return false;
+    }
+    command.op = Command::LS;
+    return true;
+}
+
+static bool parseResize(Line &line, Command &command)
+{
+    if (line.count != 3)
+    {
+        return false;
+    }
+    command.op = Command::RESIZE;
+    command.a = number(line.tokens[2]);
+    setText(command, line.tokens[1]);
+    return true;
+}
+
+static bool parseDefrag(Line &line, Command &command)
+{
+    // O -n only reports the plan
+    if (line.count == 2 && strcmp(line.tokens[1].data, "-n") == 0)
+    {
+        command.op = Command::DEFRAG_DRY_RUN;
+        return true;
+    }
+    // O <blocks> <files> starts an incremental defragmentation
+    if (line.count == 3)
+    {
+        command.op = Command::DEFRAG_START;
+        command.a = number(line.tokens[1]);
+        command.b = number(line.tokens[2]);
+        return true;
+    }
+    if (line.count > 1)
+    {
+        return false;
+    }
+    command.op = Command::DEFRAG;
+    return true;
+}
+
+static bool parseCd(Line &line, Command &command)
+{
+    if (line.count != 2)
+    {
+        return false;
+    }
+    command.op = Command::CD;
+    setText(command, line.tokens[1]);
+    return true;
+}
+
+static bool parseMetrics(Line &line, Command &command)
+{
+    // S -j prints them as JSON
+    bool json = line.count == 2 && strcmp(line.tokens[1].data, "-j") == 0;
+    if (line.count > 1 && !json)
+    {
+        return false;
+    }
+    command.op = Command::METRICS;
+    command.a = json;
+    return true;
+}
+
+bool validCommand(const Command &command)
+{
+    if (command.slot < 0 || command.slot >= FS_BUFFER_SLOTS)
+    {
+        return false;
+    }
+    switch (command.op)
+    {
+    case Command::MOUNT:
+        return command.size > 0;
+    case Command::CREATE:
+        return command.a >= 0 && command.size <= 5;
+    case Command::RESIZE:
+    case Command::DELETE:
+    case Command::CD:
+        return command.size <= 5;
+    case Command::READ:
+    case Command::WRITE:
+        return command.a >= 0 && command.b > 0 && command.size <= 5;
+    case Command::BUFF:
+        return command.size <= 1024;
+    case Command::DEFRAG_START:
+        return command.a > 0 && command.b > 0;
+    case Command::METRICS:
+        return command.a == 0 || command.a == 1;
+    default:
+        return command.op >= Command::NONE && command.op < Command::OPS;
+    }
+}
+
+// Parser of every first character of a line, nullptr where it is not a command
+struct Dispatch
+{
+    Handler handlers[256];
+
+    Dispatch()
+    {
+        for (size_t i = 0; i < 256; i++)
+        {
+            handlers[i] = nullptr;
+        }
+        handlers['M'] = parseMount;
+        handlers['C'] = parseCreate;
+        handlers['D'] = parseDelete;
+        handlers['R'] = parseBlocks;
+        handlers['W'] = parseBlocks;
+        handlers['B'] = parseBuff;
+        handlers['L'] = parseLs;
+        handlers['E'] = parseResize;
+        handlers['O'] = parseDefrag;
+        handlers['Y'] = parseCd;
+        handlers['S'] = parseMetrics;
+    }
+};
+
+static const Dispatch DISPATCH;
+
+ScriptReader::ScriptReader(istream &script)
+    : script(script), buffer(CHUNK + 1), begin(0), scanned(0), end(0), more(true), line(0)
+{
+    done = script.eof() || script.fail();
+}
+
+bool ScriptReader::next(Command &command)
+{
+    if (done)
+    {
+        return false;
+    }
+
+    // One byte of the buffer is kept for the NUL of the last line
+    char *newline = (char *)memchr(&buffer[scanned], '\n', end - scanned);
+    while (newline == nullptr && more)
+    {
+        // Keep the partial line at the front and read the next chunk after it
+        memmove(&buffer[0], &buffer[begin], end - begin);
+        end -= begin;
+        begin = 0;
+        scanned = end;
+        if (end + 1 == buffer.size())
+        {
+            buffer.resize(buffer.size() * 2);
+        }
+        script.read(&buffer[end], buffer.size() - end - 1);
+        end += script.gcount();
+        more = script.good();
+        newline = (char *)memchr(&buffer[scanned], '\n', end - scanned);
+    }
+
+    // Every newline ends a line, and what follows the last one is a line too
+    Line text = {&buffer[begin], newline ? (size_t)(newline - &buffer[begin]) : end - begin, {}, 0};
+    text.text[text.size] = '\0';
+    if (newline == nullptr)
+    {
+        done = true;
+    }
+    begin += text.size + 1;
+    scanned = begin;
+
+    command.op = text.size == 0 ? Command::NONE : Command::ERROR;
+    command.slot = 0;
+    command.line = ++line;
+    command.text = nullptr;
+    command.size = 0;
+    command.a = 0;
+    command.b = 0;
+
+    Handler handler = DISPATCH.handlers[(unsigned char)text.text[0]];
+    if (handler != nullptr)
+    {
+        split(text);
+        // The text of B is the raw rest of the line
+        if (handler != parseBuff)
+        {
+            terminate(text);
+        }
+        if (!handler(text, command) || !validCommand(command))
+        {
+            command.op = Command::ERROR;
+            command.slot = 0;
+            command.text = nullptr;
+            command.size = 0;
+        }
+    }
+    return true;
+}
+
+// Names of the commands on the timeline
+static const char *OP_NAMES[Command::OPS] = {"", "error", "M", "C", "D", "R", "W", "B", "L", "E", "O", "O start", "O -n", "Y", "S"};
+
+// Arguments of a command on its timeline span
+static void spanArgs(Timeline::Span &span, const Command &command)
+{
+    switch (command.op)
+    {
+    case Command::BUFF:
+        span.arg("slot", command.slot);
+        span.arg("bytes", command.size);
+        return;
+    case Command::CREATE:
+    case Command::RESIZE:
+        span.arg("size", command.a);
+        break;
+    case Command::READ:
+    case Command::WRITE:
+        span.arg("slot", command.slot);
+        span.arg("block", command.a);
+        span.arg("count", command.b);
+        break;
+    case Command::DEFRAG_START:
+        span.arg("blocks", command.a);
+        span.arg("files", command.b);
+        break;
+    }
+    if (command.text != nullptr)
+    {
+        span.text(command.op == Command::MOUNT ? "disk" : "name", command.text, command.size);
+    }
+}
+
+bool runCommand(FileSystem &fs, const Command &command)
+{
+    if (command.op == Command::NONE)
+    {
+        return true;
+    }
+
+    // One span per line, what the command causes nests below it
+    Timeline::Span span(command.op < Command::OPS ? OP_NAMES[command.op] : "error", command.line);
+    if (Timeline::enabled())
+    {
+        spanArgs(span, command);
+    }
+
+    // File names are padded with NULs, the file system reads name[0..4]
+    char name[6] = {0};
+    if (command.op != Command::MOUNT && command.op != Command::BUFF && command.text != nullptr)
+    {
+        memcpy(name, command.text, command.size < 5 ? command.size : 5);
+    }
+
+    switch (command.op)
+    {
+    case Command::MOUNT:
+        fs.mount((char *)command.text);
+        break;
+    case Command::CREATE:
+        if (command.a > fs.maxSize())
+        {
+            return false;
+        }
+        fs.create(name, command.a);
+        break;
+    case Command::DELETE:
+        fs.remove(name);
+        break;
+    case Command::READ:
+    case Command::WRITE:
+        if (command.a > fs.maxSize() || command.b > fs.maxSize())
+        {
+            return false;
+        }
+        if (command.op == Command::READ)
+        {
+            fs.slotRead(command.slot, name, command.a, command.b);
+        }
+        else
+        {
+            fs.slotWrite(command.slot, name, command.a, command.b);
+        }
+        break;
+    case Command::BUFF:
+        fs.slotBuff(command.slot, (char *)command.text);
+        break;
+    case Command::LS:
+        fs.ls();
+        break;
+    case Command::RESIZE:
+        if (command.a > fs.maxSize())
+        {
+            return false;
+        }
+        fs.resize(name, command.a);
+        break;
+    case Command::DEFRAG:
+        fs.defrag();
+        break;
+    case Command::DEFRAG_START:
+        fs.defragStart(command.a, command.b);
+        break;
+    case Command::DEFRAG_DRY_RUN:
+        fs.defragDryRun();
+        break;
+    case Command::CD:
+        fs.cd(name);
+        break;
+    case Command::METRICS:
+        fs.printMetrics(command.a != 0);
+        break;
+    case Command::NONE:
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+size_t runScript(FileSystem &fs, istream &script, const char *name, ostream &err, TraceWriter *record)
+{
+    ScriptReader reader(script);
+    Command command;
+    size_t commands = 0;
+    while (reader.next(command))
+    {
+        // A running incremental defragmentation takes one step between commands
+        fs.defragStep();
+        if (command.op != Command::NONE)
+        {
+            commands++;
+        }
+        if (!runCommand(fs, command))
+        {
+            err << "Command Error: " << name << ", " << command.line << endl;
+        }
+        if (record != nullptr)
+        {
+            record->add(command);
+        }
+    }
+    return commands;
+}
@@ -0,0 +1,94 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "FileSystem.h"
+
+class TraceWriter;
+
+/**
+ * One line of a script, parsed and checked. The checks against the mounted disk
+ * (sizes and blocks up to FileSystem::maxSize) are made when it runs.
+ */
+struct Command
+{
+    enum Op
+    {
+        NONE,  // Empty line
+        ERROR, // Command error
+        MOUNT,
+        CREATE,
+        DELETE,
+        READ,
+        WRITE,
+        BUFF,
+        LS,
+        RESIZE,
+        DEFRAG,
+        DEFRAG_START,
+        DEFRAG_DRY_RUN,
+        CD,
+        METRICS,
+        OPS
+    };
+
+    int op;
+    int slot;         // Buffer slot of B, R and W
+    uint32_t line;    // Line number, from 1
+    const char *text; // Disk or file name, or the text of B. NUL-terminated
+    size_t size;      // Bytes in text
+    int a;            // Size of C and E, block of R and W, blocks of O, 1 for S -j
+    int b;            // Blocks of R and W, files of O
+};
+
+/**
+ * Checks the arguments of a parsed command: names of at most 5 bytes, sizes of C not
+ * negative (fs_resize rejects a negative E size itself), R/W blocks not negative and counts above 0, B text of at most 1024
+ * bytes, O budgets above 0, S flag 0 or 1 and a buffer slot that exists. Scripts and
+ * traces both go through it, so a command that fails it never runs.
+ */
+bool validCommand(const Command &command);
+
+/**
+ * Reads a script in large chunks and parses it line by line in place, a line costs
+ * no allocation. Every line of the script is returned, empty ones too.
+ */
+class ScriptReader
+{
+public:
+    explicit ScriptReader(std::istream &script);
+
+    // Parses the next line, false after the last one. The text of the command
+    // stays valid until the next call.
+    bool next(Command &command);
+
+private:
+    std::istream &script;
+    std::vector<char> buffer;
+    size_t begin;   // [begin, end) is not parsed yet
+    size_t scanned; // [begin, scanned) has no newline
+    size_t end;
+    bool more; // The stream has more bytes
+    bool done; // The last line was returned
+    uint32_t line;
+};
+
+/**
+ * Runs a parsed command on fs. Returns false on a command error, nothing was run then.
+ */
+bool runCommand(FileSystem &fs, const Command &command);
+
+/**
+ * Runs a command script (one command per line, see README) on fs. name is the script
+ * name of the command errors, which go to err with the messages of fs (see
+ * FileSystem::setOutput). Every line is added to record when it is given.
+ * Returns the number of non-empty lines.
+ */
+size_t runScript(FileSystem &fs, std::istream &script, const char *name, std::ostream &err, TraceWriter *record = nullptr);
+
+#endif
@@ -0,0 +1,275 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <sys/stat.h>
+
+#include "FSHelper.h"
+#include "Snapshot.h"
+
+using namespace std;
+
+static const char MAGIC[4] = {'F', 'S', 'S', 'N'};
+static const uint32_t VERSION = 2;
+static const int STAMP_WORDS = 5;
+static const size_t HEADER_SIZE = 80;
+
+// Little-endian helpers of the snapshot format
+static uint32_t getU32(const char *b)
+{
+    const unsigned char *u = (const unsigned char *)b;
+    return (uint32_t)u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static uint64_t getU64(const char *b)
+{
+    return (uint64_t)getU32(b) | (uint64_t)getU32(b + 4) << 32;
+}
+
+static void putU32(char *b, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        b[i] = (char)(value >> (8 * i));
+    }
+}
+
+static void putU64(char *b, uint64_t value)
+{
+    putU32(b, (uint32_t)value);
+    putU32(b + 4, (uint32_t)(value >> 32));
+}
+
+static uint64_t mix(uint64_t hash, uint64_t value)
+{
+    hash = (hash ^ value) * 0xBF58476D1CE4E5B9ull;
+    return hash ^ (hash >> 31);
+}
+
+// Checksum of size bytes, read as little-endian words
+static uint64_t checksum(const char *bytes, size_t size)
+{
+    uint64_t hash = mix(0x9E3779B97F4A7C15ull, size);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        hash = mix(hash, getU64(bytes + i));
+    }
+    char tail[8] = {0};
+    memcpy(tail, bytes + i, size - i);
+    return mix(hash, getU64(tail));
+}
+
+// Identity and last change of the image file: device, inode, size, and the modification
+// and status change times in ns. Every write to the image moves them.
+static bool imageStamp(int image, uint64_t stamp[STAMP_WORDS])
+{
+    struct stat status;
+    if (fstat(image, &status) != 0)
+    {
+        return false;
+    }
+    stamp[0] = (uint64_t)status.st_dev;
+    stamp[1] = (uint64_t)status.st_ino;
+    stamp[2] = (uint64_t)status.st_size;
+    stamp[3] = (uint64_t)status.st_mtim.tv_sec * 1000000000ull + (uint64_t)status.st_mtim.tv_nsec;
+    stamp[4] = (uint64_t)status.st_ctim.tv_sec * 1000000000ull + (uint64_t)status.st_ctim.tv_nsec;
+    return true;
+}
+
+string Snapshot::path(const string &disk)
+{
+    return disk + ".snap";
+}
+
+bool Snapshot::save(const char *path, const FS_super_block *super_block, int image)
+{
+    uint64_t stamp[STAMP_WORDS];
+    if (!imageStamp(image, stamp))
+    {
+        return false;
+    }
+
+    // The lists buildFS() fills the directory index from
+    vector<pair<uint32_t, uint32_t>> directories;
+    vector<uint32_t> entries;
+    if (!childLists(super_block, directories, entries))
+    {
+        return false;
+    }
+
+    vector<pair<size_t, size_t>> extents;
+    const BlockBitmap &free_blocks = super_block->free_block_list;
+    size_t length = 0;
+    size_t start = free_blocks.nextRun(super_block->data_start, length);
+    while (start < free_blocks.size())
+    {
+        extents.push_back(make_pair(start, length));
+        start = free_blocks.nextRun(start + length, length);
+    }
+
+    vector<char> bytes(HEADER_SIZE + directories.size() * 8 + entries.size() * 4 + extents.size() * 16);
+    char *b = &bytes[HEADER_SIZE];
+    for (size_t d = 0; d < directories.size(); d++, b += 8)
+    {
+        putU32(b, directories[d].first);
+        putU32(b + 4, directories[d].second);
+    }
+    for (size_t e = 0; e < entries.size(); e++, b += 4)
+    {
+        putU32(b, entries[e]);
+    }
+    for (size_t e = 0; e < extents.size(); e++, b += 16)
+    {
+        putU64(b, extents[e].first);
+        putU64(b + 8, extents[e].second);
+    }
+
+    char *header = &bytes[0];
+    memcpy(header, MAGIC, 4);
+    putU32(header + 4, VERSION);
+    for (int i = 0; i < STAMP_WORDS; i++)
+    {
+        putU64(header + 8 + i * 8, stamp[i]);
+    }
+    putU32(header + 48, super_block->num_blocks);
+    putU32(header + 52, super_block->num_inodes);
+    putU32(header + 56, (uint32_t)directories.size());
+    putU32(header + 60, (uint32_t)entries.size());
+    putU32(header + 64, (uint32_t)extents.size());
+    putU32(header + 68, 0);
+    putU64(header + 72, checksum(bytes.data() + HEADER_SIZE, bytes.size() - HEADER_SIZE));
+
+    // A reader sees the old file or the whole new one
+    string temporary = string(path) + ".tmp";
+    ofstream file(temporary.c_str(), ios::binary | ios::trunc);
+    if (!file.write(&bytes[0], bytes.size()) || !file.flush())
+    {
+        file.close();
+        remove(temporary.c_str());
+        return false;
+    }
+    file.close();
+    if (rename(temporary.c_str(), path) != 0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Snapshot::load(const char *path, const FS_super_block *super_block, int image)
+{
+    directories.clear();
+    entries.clear();
+    extents.clear();
+
+    ifstream file(path, ios::binary | ios::ate);
+    if (!file)
+    {
+        return false;
+    }
+    streamoff size = file.tellg();
+    if (size < (streamoff)HEADER_SIZE)
+    {
+        return false;
+    }
+    vector<char> bytes((size_t)size);
+    file.seekg(0);
+    if (!file.read(&bytes[0], bytes.size()))
+    {
+        return false;
+    }
+
+    // The image must not have changed since the snapshot was saved
+    const char *header = &bytes[0];
+    uint64_t stamp[STAMP_WORDS];
+    if (memcmp(header, MAGIC, 4) != 0 || getU32(header + 4) != VERSION || !imageStamp(image, stamp))
+    {
+        return false;
+    }
+    for (int i = 0; i < STAMP_WORDS; i++)
+    {
+        if (getU64(header + 8 + i * 8) != stamp[i])
+        {
+            return false;
+        }
+    }
+    uint64_t count[3] = {getU32(header + 56), getU32(header + 60), getU32(header + 64)};
+    if (getU32(header + 68) != 0 || getU32(header + 48) != super_block->num_blocks ||
+        getU32(header + 52) != super_block->num_inodes ||
+        bytes.size() != HEADER_SIZE + count[0] * 8 + count[1] * 4 + count[2] * 16 ||
+        getU64(header + 72) != checksum(bytes.data() + HEADER_SIZE, bytes.size() - HEADER_SIZE))
+    {
+        return false;
+    }
+
+    // Every directory in use has a list and every inode in use is listed once (below)
+    uint32_t used = 0;
+    uint32_t dirs = 0;
+    for (uint32_t i = 0; i < super_block->num_inodes; i++)
+    {
+        used += super_block->inode[i].used;
+        dirs += super_block->inode[i].used && super_block->inode[i].dir;
+    }
+    if (count[0] != 1 + (uint64_t)dirs || count[1] != used)
+    {
+        return false;
+    }
+
+    // Directories: the root first, then directory inodes in increasing order
+    const char *b = bytes.data() + HEADER_SIZE;
+    uint64_t total = 0;
+    for (uint64_t d = 0; d < count[0]; d++, b += 8)
+    {
+        uint32_t dir = getU32(b);
+        if (d == 0 ? dir != super_block->root
+                   : dir >= super_block->num_inodes || !super_block->inode[dir].used ||
+                         !super_block->inode[dir].dir || (d > 1 && dir <= directories.back().first))
+        {
+            return false;
+        }
+        directories.push_back(make_pair(dir, getU32(b + 4)));
+        total += directories.back().second;
+    }
+    if (total != count[1])
+    {
+        return false;
+    }
+
+    // Entries: the children of each directory in increasing order, every inode in use once
+    for (size_t d = 0; d < directories.size(); d++)
+    {
+        for (uint32_t e = 0; e < directories[d].second; e++, b += 4)
+        {
+            uint32_t inode = getU32(b);
+            if (inode >= super_block->num_inodes || !super_block->inode[inode].used ||
+                super_block->inode[inode].dir_parent != directories[d].first || (e > 0 && inode <= entries.back()))
+            {
+                return false;
+            }
+            entries.push_back(inode);
+        }
+    }
+
+    // Extents: exactly the runs of free blocks of the free-space list
+    const BlockBitmap &free_blocks = super_block->free_block_list;
+    size_t length = 0;
+    size_t start = free_blocks.nextRun(super_block->data_start, length);
+    for (uint64_t e = 0; e < count[2]; e++, b += 16)
+    {
+        if (start >= free_blocks.size() || getU64(b) != start || getU64(b + 8) != length)
+        {
+            return false;
+        }
+        extents.push_back(make_pair(start, length));
+        start = free_blocks.nextRun(start + length, length);
+    }
+    return start >= free_blocks.size();
+}
+
+void Snapshot::apply(const FS_super_block *super_block, DirIndex *tree, FreeExtents *extents) const
+{
+    buildFS(super_block, directories, entries, tree);
+    extents->assign(this->extents);
+}
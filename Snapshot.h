@@ -0,0 +1,56 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "DirIndex.h"
+#include "FreeExtents.h"
+
+struct FS_super_block;
+
+/**
+ * Derived state of a consistent superblock, kept in a sidecar file next to the disk
+ * image: the lists of childLists() the directory index is built from, the free
+ * extents, and a stamp of the image file they were derived from (device, inode, size,
+ * modification and status change times). A mount of an image with the same stamp loads
+ * them instead of running ccheck(), childLists() and FreeExtents::build(). Loading reads
+ * no more of the superblock than the used and dir flags of the inodes, the inodes in the
+ * lists and the free-space list: the lists must hold every inode in use once under its
+ * parent and the extents must be the free runs, so they are what childLists() and
+ * FreeExtents::build() would give. That the superblock is still consistent rests on the
+ * stamp, see the limitations in the README.
+ *
+ * All integers are little-endian. An 80 byte header:
+ *   "FSSN", version, image stamp (5 x 8 bytes), num_blocks, num_inodes, directories,
+ *   entries, extents, 0, checksum of the rest of the file (8 bytes)
+ * then directories x (inode, entry count), entries x inode and extents x (start, length),
+ * the root directory first and everything else in inode or block order.
+ */
+class Snapshot
+{
+public:
+    // Sidecar file of the disk image at disk
+    static std::string path(const std::string &disk);
+
+    // Writes the snapshot of a consistent superblock, read from the image open at
+    // descriptor image, to path. False if it cannot be written.
+    static bool save(const char *path, const FS_super_block *super_block, int image);
+
+    // Reads path and checks it against the image and its superblock, false if it is
+    // missing or does not match
+    bool load(const char *path, const FS_super_block *super_block, int image);
+
+    // Replaces tree and extents with the loaded state of super_block
+    void apply(const FS_super_block *super_block, DirIndex *tree, FreeExtents *extents) const;
+
+private:
+    std::vector<std::pair<uint32_t, uint32_t>> directories; // (inode, entry count)
+    std::vector<uint32_t> entries;
+    std::vector<std::pair<size_t, size_t>> extents;         // (start, length)
+};
+
+#endif
@@ -0,0 +1,193 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "Metrics.h"
+#include "Timeline.h"
+
+using namespace std;
+
+// Events of one thread, kept after the thread ends until the timeline is written
+struct Ring
+{
+    vector<Timeline::Event> events;
+    atomic<uint64_t> added; // Events added since start(), the ring holds the last ones
+    uint32_t thread;
+};
+
+static atomic<bool> recording(false);
+static size_t ringEvents = Timeline::EVENTS;
+static uint64_t origin; // Time of start(), the events are written relative to it
+
+// Every ring ever made, a thread keeps a pointer to its own
+static mutex ringsLock;
+static vector<Ring *> rings;
+
+static thread_local Ring *threadRing = nullptr;
+static thread_local uint32_t threadLine = 0;
+
+Timeline::Span::Span(const char *name) : active(enabled()), previousLine(threadLine)
+{
+    if (active)
+    {
+        memset(&event, 0, sizeof(event));
+        event.name = name;
+        event.start = Metrics::now();
+    }
+}
+
+Timeline::Span::Span(const char *name, uint32_t line) : Span(name)
+{
+    threadLine = line;
+}
+
+Timeline::Span::~Span()
+{
+    if (active)
+    {
+        event.duration = Metrics::now() - event.start;
+        add(event);
+    }
+    threadLine = previousLine;
+}
+
+void Timeline::Span::arg(const char *key, int64_t value)
+{
+    if (active)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            if (event.keys[i] == nullptr)
+            {
+                event.keys[i] = key;
+                event.values[i] = value;
+                break;
+            }
+        }
+    }
+}
+
+void Timeline::Span::text(const char *key, const char *text, size_t size)
+{
+    if (active)
+    {
+        size = size < sizeof(event.text) - 1 ? size : sizeof(event.text) - 1;
+        event.textKey = key;
+        memcpy(event.text, text, size);
+        event.text[size] = '\0';
+    }
+}
+
+void Timeline::start(size_t events)
+{
+    lock_guard<mutex> lock(ringsLock);
+    ringEvents = events > 0 ? events : 1;
+    for (size_t i = 0; i < rings.size(); i++)
+    {
+        rings[i]->events.assign(ringEvents, Event());
+        rings[i]->added.store(0, memory_order_relaxed);
+    }
+    origin = Metrics::now();
+    recording.store(true, memory_order_release);
+}
+
+void Timeline::stop()
+{
+    recording.store(false, memory_order_release);
+}
+
+bool Timeline::enabled()
+{
+    return recording.load(memory_order_relaxed);
+}
+
+void Timeline::add(Event &event)
+{
+    if (!enabled())
+    {
+        return;
+    }
+    if (threadRing == nullptr)
+    {
+        lock_guard<mutex> lock(ringsLock);
+        threadRing = new Ring();
+        threadRing->events.resize(ringEvents);
+        threadRing->added.store(0, memory_order_relaxed);
+        threadRing->thread = (uint32_t)rings.size() + 1;
+        rings.push_back(threadRing);
+    }
+    event.line = threadLine;
+    uint64_t added = threadRing->added.load(memory_order_relaxed);
+    threadRing->events[added % threadRing->events.size()] = event;
+    threadRing->added.store(added + 1, memory_order_release);
+}
+
+// Writes text as the contents of a JSON string
+static void writeString(FILE *file, const char *text)
+{
+    for (; *text != '\0'; text++)
+    {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\')
+        {
+            fprintf(file, "\\%c", c);
+        }
+        else if (c < 0x20 || c >= 0x7F)
+        {
+            fprintf(file, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, file);
+        }
+    }
+}
+
+bool Timeline::write(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    lock_guard<mutex> lock(ringsLock);
+    uint64_t dropped = 0;
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (size_t r = 0; r < rings.size(); r++)
+    {
+        const Ring &ring = *rings[r];
+        fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": "
+                      "\"thread %u\"}}",
+                r == 0 ? "" : ",\n", ring.thread, ring.thread);
+
+        // The oldest event still in the ring first
+        uint64_t added = ring.added.load(memory_order_acquire);
+        uint64_t first = added > ring.events.size() ? added - ring.events.size() : 0;
+        dropped += first;
+        for (uint64_t i = first; i < added; i++)
+        {
+            const Event &event = ring.events[i % ring.events.size()];
+            fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+                          "\"args\": {",
+                    event.name, ring.thread, event.start < origin ? 0.0 : (event.start - origin) / 1e3,
+                    event.duration / 1e3);
+            fprintf(file, "\"line\": %u", event.line);
+            for (int k = 0; k < 3 && event.keys[k] != nullptr; k++)
+            {
+                fprintf(file, ", \"%s\": %lld", event.keys[k], (long long)event.values[k]);
+            }
+            if (event.textKey != nullptr)
+            {
+                fprintf(file, ", \"%s\": \"", event.textKey);
+                writeString(file, event.text);
+                fputc('"', file);
+            }
+            fprintf(file, "}}");
+        }
+    }
+    fprintf(file, "\n], \"otherData\": {\"dropped_events\": \"%llu\"}}\n", (unsigned long long)dropped);
+    return fclose(file) == 0;
+}
@@ -0,0 +1,69 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Timeline of what the file system does, written as Chrome trace-event JSON (open it in
+ * chrome://tracing or ui.perfetto.dev). Off by default. Once started, every Span adds
+ * one complete event with its start, duration, the script line its thread is running
+ * and up to three numbers and a name as arguments. Spans of one thread nest by time, so a
+ * command shows the superblock writes, moves and disk calls it caused below it.
+ *
+ * Each thread adds to a ring buffer of its own, without a lock; a full ring overwrites
+ * its oldest events. write() reads every ring, so no thread may add events then.
+ */
+class Timeline
+{
+public:
+    // Events kept per thread by default
+    static const size_t EVENTS = 1 << 16;
+
+    struct Event
+    {
+        const char *name;   // Static string
+        uint64_t start;     // Metrics::now() ns
+        uint64_t duration;  // ns
+        uint32_t line;      // Script line, 0 outside a script
+        const char *keys[3]; // Names of the numeric arguments, nullptr when unused
+        int64_t values[3];
+        const char *textKey; // Name of the text argument, nullptr when unused
+        char text[16];
+    };
+
+    // An event from its construction to its end, nothing when the timeline is off
+    class Span
+    {
+    public:
+        explicit Span(const char *name);
+
+        // A span of a script line: the spans inside it carry the line too
+        Span(const char *name, uint32_t line);
+        ~Span();
+
+        void arg(const char *key, int64_t value);
+        void text(const char *key, const char *text, size_t size);
+
+    private:
+        Span(const Span &);
+        Span &operator=(const Span &);
+
+        Event event;
+        bool active;
+        uint32_t previousLine;
+    };
+
+    // Starts recording with rings of events entries, dropping what was recorded before
+    static void start(size_t events = EVENTS);
+    static void stop();
+    static bool enabled();
+
+    // Adds a finished event of the current thread, with its current line
+    static void add(Event &event);
+
+    // Writes the events of every thread to path, false if it cannot be written
+    static bool write(const char *path);
+};
+
+#endif
@@ -0,0 +1,244 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "Trace.h"
+
+using namespace std;
+
+static const size_t HEADER_SIZE = 24;
+static const size_t RECORD_SIZE = 20;
+
+// Little-endian helpers of the trace format
+static uint32_t getU32(const char *b)
+{
+    const unsigned char *u = (const unsigned char *)b;
+    return (uint32_t)u[0] | (uint32_t)u[1] << 8 | (uint32_t)u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static void putU32(char *b, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        b[i] = (char)(value >> (8 * i));
+    }
+}
+
+// Ops that run with a name or a text
+static bool hasText(int op)
+{
+    return op != Command::ERROR && op != Command::LS && op != Command::DEFRAG && op != Command::DEFRAG_START &&
+           op != Command::DEFRAG_DRY_RUN && op != Command::METRICS;
+}
+
+TraceWriter::TraceWriter(const char *script) : count(0), lines(0)
+{
+    name = intern(script, strlen(script));
+}
+
+uint32_t TraceWriter::intern(const char *text, size_t size)
+{
+    pair<unordered_map<string, uint32_t>::iterator, bool> entry =
+        index.insert(make_pair(string(text, size), (uint32_t)strings.size()));
+    if (entry.second)
+    {
+        // Keys of an unordered_map keep their address
+        strings.push_back(&entry.first->first);
+    }
+    return entry.first->second;
+}
+
+void TraceWriter::add(const Command &command)
+{
+    lines = command.line;
+    if (command.op == Command::NONE)
+    {
+        return;
+    }
+
+    char record[RECORD_SIZE] = {0};
+    record[0] = (char)command.op;
+    record[1] = (char)command.slot;
+    putU32(record + 4, command.line);
+    putU32(record + 8, hasText(command.op) ? intern(command.text, command.size) : NO_STRING);
+    putU32(record + 12, (uint32_t)command.a);
+    putU32(record + 16, (uint32_t)command.b);
+    bytes.insert(bytes.end(), record, record + RECORD_SIZE);
+    count++;
+}
+
+bool TraceWriter::save(const char *path) const
+{
+    ofstream trace(path, ios::binary | ios::trunc);
+    if (!trace.is_open())
+    {
+        return false;
+    }
+
+    char header[HEADER_SIZE];
+    memcpy(header, "FSTR", 4);
+    putU32(header + 4, TRACE_VERSION);
+    putU32(header + 8, lines);
+    putU32(header + 12, (uint32_t)count);
+    putU32(header + 16, (uint32_t)strings.size());
+    putU32(header + 20, name);
+    trace.write(header, HEADER_SIZE);
+    trace.write(bytes.data(), bytes.size());
+
+    for (size_t i = 0; i < strings.size(); i++)
+    {
+        char size[4];
+        putU32(size, (uint32_t)strings[i]->size());
+        trace.write(size, 4);
+        trace.write(strings[i]->c_str(), strings[i]->size() + 1);
+    }
+    return trace.good();
+}
+
+bool Trace::load(const char *path)
+{
+    ifstream trace(path, ios::binary);
+    if (!trace.is_open())
+    {
+        return false;
+    }
+    trace.seekg(0, ios::end);
+    streamoff length = trace.tellg();
+    trace.seekg(0, ios::beg);
+    if (length < (streamoff)HEADER_SIZE)
+    {
+        return false;
+    }
+    bytes.resize(length);
+    if (!trace.read(bytes.data(), length))
+    {
+        return false;
+    }
+
+    if (memcmp(bytes.data(), "FSTR", 4) != 0 || getU32(&bytes[4]) != TRACE_VERSION)
+    {
+        return false;
+    }
+    lines = getU32(&bytes[8]);
+    records = getU32(&bytes[12]);
+    uint32_t strings = getU32(&bytes[16]);
+    name = getU32(&bytes[20]);
+    if ((uint64_t)records * RECORD_SIZE > bytes.size() - HEADER_SIZE)
+    {
+        return false;
+    }
+
+    // Every string is in the file and ends with its NUL
+    offsets.clear();
+    sizes.clear();
+    size_t at = HEADER_SIZE + records * RECORD_SIZE;
+    for (uint32_t i = 0; i < strings; i++)
+    {
+        if (bytes.size() - at < 4)
+        {
+            return false;
+        }
+        uint32_t size = getU32(&bytes[at]);
+        if (bytes.size() - at - 4 <= size || bytes[at + 4 + size] != '\0')
+        {
+            return false;
+        }
+        offsets.push_back((uint32_t)(at + 4));
+        sizes.push_back(size);
+        at += 4 + size + 1;
+    }
+    if (name >= strings)
+    {
+        return false;
+    }
+
+    // A record that replays runs on a valid command
+    uint32_t line = 0;
+    for (size_t i = 0; i < records; i++)
+    {
+        const char *record = &bytes[HEADER_SIZE + i * RECORD_SIZE];
+        int op = (unsigned char)record[0];
+        uint32_t string = getU32(record + 8);
+        if (op <= Command::NONE || op >= Command::OPS || (unsigned char)record[1] >= FS_BUFFER_SLOTS)
+        {
+            return false;
+        }
+        if (hasText(op) ? string >= strings : string != NO_STRING)
+        {
+            return false;
+        }
+        if (getU32(record + 4) <= line || getU32(record + 4) > lines)
+        {
+            return false;
+        }
+        line = getU32(record + 4);
+
+        // The same argument checks as a script line
+        Command command;
+        get(i, command);
+        if (!validCommand(command))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Trace::get(size_t i, Command &command) const
+{
+    const char *record = &bytes[HEADER_SIZE + i * RECORD_SIZE];
+    uint32_t string = getU32(record + 8);
+    command.op = (unsigned char)record[0];
+    command.slot = (unsigned char)record[1];
+    command.line = getU32(record + 4);
+    command.text = text(string);
+    command.size = string == NO_STRING ? 0 : sizes[string];
+    command.a = (int)getU32(record + 12);
+    command.b = (int)getU32(record + 16);
+}
+
+long compileTrace(const char *path, const char *trace)
+{
+    ifstream script(path);
+    if (!script.is_open())
+    {
+        return -1;
+    }
+
+    ScriptReader reader(script);
+    TraceWriter writer(path);
+    Command command;
+    while (reader.next(command))
+    {
+        writer.add(command);
+    }
+    return writer.save(trace) ? (long)writer.records() : -1;
+}
+
+size_t replayTrace(FileSystem &fs, const Trace &trace, ostream &err)
+{
+    Command command;
+    uint32_t line = 0;
+    for (size_t i = 0; i < trace.size(); i++)
+    {
+        trace.get(i, command);
+
+        // A running incremental defragmentation takes one step for every line,
+        // the empty ones that have no record too
+        while (line < command.line)
+        {
+            fs.defragStep();
+            line++;
+        }
+        if (!runCommand(fs, command))
+        {
+            err << "Command Error: " << trace.script() << ", " << command.line << endl;
+        }
+    }
+    while (line < trace.lineCount())
+    {
+        fs.defragStep();
+        line++;
+    }
+    return trace.size();
+}
@@ -0,0 +1,93 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "FileSystem.h"
+#include "Script.h"
+
+/**
+ * Compiled command trace: a script that was parsed and checked ahead of time, so a
+ * replay only runs the commands. Little-endian:
+ *
+ *   header, 24 bytes:  "FSTR", version (1), lines, records, strings, script name (a string)
+ *   records, 20 bytes: op (1), slot (1), unused (2), line (4), string (4), a (4), b (4)
+ *   strings:           length (4), bytes, NUL
+ *
+ * Records are in line order. Empty lines have none, a command error has an ERROR record
+ * so the replay reports it on its line. Every name and buffer text is stored once in the
+ * string table, records refer to it by index (NO_STRING when they have no text).
+ */
+static const uint32_t TRACE_VERSION = 1;
+static const uint32_t NO_STRING = 0xFFFFFFFF;
+
+// Builds a trace from the commands of a script
+class TraceWriter
+{
+public:
+    // script is the name the command errors of the replay report
+    explicit TraceWriter(const char *script);
+
+    // Adds one line of the script
+    void add(const Command &command);
+
+    // Writes the trace to path, false if it cannot be written
+    bool save(const char *path) const;
+
+    size_t records() const { return count; }
+
+private:
+    uint32_t intern(const char *text, size_t size);
+
+    std::vector<char> bytes; // Records
+    size_t count;
+    uint32_t lines;
+    std::vector<const std::string *> strings;
+    std::unordered_map<std::string, uint32_t> index;
+    uint32_t name;
+};
+
+// Trace loaded in memory, records are decoded when they run
+class Trace
+{
+public:
+    // Reads the trace at path, false if it cannot be read or is not a valid trace
+    bool load(const char *path);
+
+    size_t size() const { return records; }
+    uint32_t lineCount() const { return lines; }
+    const char *script() const { return text(name); }
+
+    // Record i as a command, its text points into the trace
+    void get(size_t i, Command &command) const;
+
+private:
+    const char *text(uint32_t string) const { return string == NO_STRING ? nullptr : &bytes[offsets[string]]; }
+
+    std::vector<char> bytes;       // Whole file
+    std::vector<uint32_t> offsets; // First byte of every string
+    std::vector<uint32_t> sizes;
+    size_t records;
+    uint32_t lines;
+    uint32_t name;
+};
+
+/**
+ * Compiles the script at path into a trace at trace. Returns the number of commands,
+ * -1 if the script cannot be read or the trace cannot be written.
+ */
+long compileTrace(const char *path, const char *trace);
+
+/**
+ * Runs a trace on fs: the same messages, command errors and defragmentation steps as
+ * runScript on the script it was compiled from. Returns the number of commands.
+ */
+size_t replayTrace(FileSystem &fs, const Trace &trace, std::ostream &err);
+
+#endif
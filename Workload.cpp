@@ -0,0 +1,492 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Workload.h"
+#include "FSHelper.h"
+
+using namespace std;
+
+WorkloadParams::WorkloadParams()
+    : seed(1), commands(1000), disk("disk"), blocks(65536), inodes(4096), minSize(1), maxSize(64), logSizes(true),
+      depth(2), creates(40), deletes(30), resizes(30), io(50), reads(70), ranges(0), fill(70), fragmentation(30), defrag(0),
+      format(0)
+{
+}
+
+// Parses a decimal value of a parameter, false if it is not one
+static bool parseNumber(const char *text, uint32_t &value)
+{
+    char *end;
+    unsigned long number = strtoul(text, &end, 10);
+    if (*text < '0' || *text > '9' || *end != '\0' || number > 0xFFFFFFFF)
+    {
+        return false;
+    }
+    value = (uint32_t)number;
+    return true;
+}
+
+// Parses "a:b" (or "a:b:c"), false if the form or a value is not valid
+static bool parseList(const char *text, uint32_t *values, int count)
+{
+    char copy[64];
+    if (strlen(text) >= sizeof(copy))
+    {
+        return false;
+    }
+    strcpy(copy, text);
+    char *state;
+    char *field = strtok_r(copy, ":", &state);
+    for (int i = 0; i < count; i++)
+    {
+        if (field == NULL || !parseNumber(field, values[i]))
+        {
+            return false;
+        }
+        field = strtok_r(NULL, ":", &state);
+    }
+    return field == NULL;
+}
+
+bool WorkloadParams::set(const char *argument)
+{
+    const char *equals = strchr(argument, '=');
+    if (equals == NULL || equals[1] == '\0')
+    {
+        return false;
+    }
+    string key(argument, equals - argument);
+    const char *value = equals + 1;
+
+    if (key == "disk")
+    {
+        disk = value;
+        return true;
+    }
+    if (key == "dist")
+    {
+        logSizes = strcmp(value, "log") == 0;
+        return logSizes || strcmp(value, "uniform") == 0;
+    }
+    if (key == "sizes")
+    {
+        uint32_t sizes[2];
+        if (!parseList(value, sizes, 2) || sizes[0] == 0 || sizes[0] > sizes[1])
+        {
+            return false;
+        }
+        minSize = sizes[0];
+        maxSize = sizes[1];
+        return true;
+    }
+    if (key == "mix")
+    {
+        uint32_t mix[3];
+        if (!parseList(value, mix, 3) || mix[0] + mix[1] + mix[2] == 0)
+        {
+            return false;
+        }
+        creates = mix[0];
+        deletes = mix[1];
+        resizes = mix[2];
+        return true;
+    }
+
+    struct
+    {
+        const char *key;
+        uint32_t *value;
+        uint32_t min;
+        uint32_t max;
+    } numbers[] = {
+        {"seed", &seed, 0, 0xFFFFFFFF},      {"commands", &commands, 0, 0xFFFFFFFF},
+        {"blocks", &blocks, 128, 0x7FFFFFFF}, {"inodes", &inodes, 2, FS_V2_ROOT - 1},
+        {"depth", &depth, 0, 64},            {"io", &io, 0, 100},
+        {"reads", &reads, 0, 100},           {"fill", &fill, 1, 95},
+        {"frag", &fragmentation, 0, 100},    {"defrag", &defrag, 0, 0xFFFFFFFF},
+        {"format", &format, 1, 2},           {"ranges", &ranges, 0, 100},
+    };
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++)
+    {
+        uint32_t number;
+        if (key == numbers[i].key)
+        {
+            if (!parseNumber(value, number) || number < numbers[i].min || number > numbers[i].max)
+            {
+                return false;
+            }
+            *numbers[i].value = number;
+            return true;
+        }
+    }
+    return false;
+}
+
+Workload::Workload(const WorkloadParams &params)
+    : params(params), nodes(1), cwd(0), live(0), used(0), names(0), count(0), random(params.seed), mounted(false)
+{
+    nodes[0].name[0] = '\0';
+    nodes[0].dir = true;
+    nodes[0].size = 0;
+    nodes[0].start = 0;
+    nodes[0].parent = 0;
+    nodes[0].depth = 0;
+
+    if (params.format == 1 || (params.format == 0 && params.blocks == 128 && params.inodes == 126))
+    {
+        // A v1 disk, the data blocks follow the superblock
+        this->params.blocks = 128;
+        this->params.inodes = 126;
+        dataStart = 1;
+    }
+    else
+    {
+        // Data blocks of a v2 disk, the bitmap and the inode table come first
+        uint64_t metadata = 1 + (params.blocks + 8191) / 8192 + ((uint64_t)params.inodes * 32 + 1023) / 1024;
+        dataStart = (uint32_t)min<uint64_t>(metadata, params.blocks - 1);
+    }
+    capacity = this->params.blocks - dataStart;
+    space.assign(vector<pair<size_t, size_t>>(1, make_pair((size_t)dataStart, (size_t)capacity)));
+}
+
+uint32_t Workload::pick(uint32_t bound)
+{
+    return bound == 0 ? 0 : random() % bound;
+}
+
+uint32_t Workload::fileSize()
+{
+    uint32_t low = params.minSize;
+    // One file always fits the fill level of an empty disk
+    uint32_t high = (uint32_t)min<uint64_t>(params.maxSize, max<uint64_t>(capacity * params.fill / 100, 1));
+    if (low >= high)
+    {
+        return high;
+    }
+    if (!params.logSizes)
+    {
+        return low + pick(high - low + 1);
+    }
+
+    // Log-uniform in whole powers of two: as many files in [1, 2) as in [32, 64)
+    int first = 31 - __builtin_clz(low);
+    int last = 31 - __builtin_clz(high);
+    int power = first + pick(last - first + 1);
+    uint64_t from = max<uint64_t>(low, 1u << power);
+    uint64_t to = min<uint64_t>(high, (2ull << power) - 1);
+    return (uint32_t)(from + pick((uint32_t)(to - from + 1)));
+}
+
+void Workload::newName(char prefix, char name[6])
+{
+    // 36^4 names of each kind, then they are used again
+    static const char DIGITS[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    uint32_t number = names++;
+    name[0] = prefix;
+    for (int i = 4; i >= 1; i--)
+    {
+        name[i] = DIGITS[number % 36];
+        number /= 36;
+    }
+    name[5] = '\0';
+}
+
+bool Workload::pickEntry(bool dir, uint32_t &node)
+{
+    const vector<uint32_t> &entries = nodes[cwd].children;
+    size_t matching = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        matching += nodes[entries[i]].dir == dir;
+    }
+    if (matching == 0)
+    {
+        return false;
+    }
+    size_t chosen = pick((uint32_t)matching);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (nodes[entries[i]].dir == dir && chosen-- == 0)
+        {
+            node = entries[i];
+            break;
+        }
+    }
+    return true;
+}
+
+void Workload::drop(uint32_t node)
+{
+    vector<uint32_t> &siblings = nodes[nodes[node].parent].children;
+    siblings.erase(find(siblings.begin(), siblings.end(), node));
+
+    vector<uint32_t> below(1, node);
+    while (!below.empty())
+    {
+        Node &current = nodes[below.back()];
+        below.pop_back();
+        below.insert(below.end(), current.children.begin(), current.children.end());
+        current.children.clear();
+        if (current.size > 0)
+        {
+            space.release(current.start, current.size);
+        }
+        used -= current.size;
+        live--;
+    }
+}
+
+void Workload::create(string &line)
+{
+    uint32_t size = fileSize();
+    bool dir = nodes[cwd].depth < params.depth && pick(16) == 0;
+    // A file that no free extent holds would fail to allocate, as one past the fill level
+    long start = dir ? 0 : space.firstFit(size);
+    if (live + 1 >= params.inodes || (!dir && (used + size > capacity * params.fill / 100 || start < 0)))
+    {
+        remove(line);
+        return;
+    }
+
+    Node node;
+    newName(dir ? 'd' : 'f', node.name);
+    node.dir = dir;
+    node.size = dir ? 0 : size;
+    node.start = (uint32_t)start;
+    if (!dir)
+    {
+        space.allocate(node.start, size);
+    }
+    node.parent = cwd;
+    node.depth = nodes[cwd].depth + 1;
+    nodes[cwd].children.push_back((uint32_t)nodes.size());
+    nodes.push_back(node);
+    live++;
+    used += node.size;
+
+    char text[32];
+    snprintf(text, sizeof(text), "C %s %u", node.name, node.size);
+    line = text;
+}
+
+void Workload::remove(string &line)
+{
+    // Directories go rarely, with everything in them
+    uint32_t node;
+    if (!(pick(16) == 0 && pickEntry(true, node)) && !pickEntry(false, node))
+    {
+        // Nothing to delete here, look elsewhere
+        move(line);
+        return;
+    }
+    line = string("D ") + nodes[node].name;
+    drop(node);
+}
+
+void Workload::resize(string &line)
+{
+    uint32_t node;
+    if (!pickEntry(false, node))
+    {
+        create(line);
+        return;
+    }
+
+    // A new size from the distribution, or half the size if the disk is full
+    Node &file = nodes[node];
+    uint32_t size = fileSize();
+    if (used - file.size + size > capacity * params.fill / 100)
+    {
+        size = max(file.size / 2, 1u);
+    }
+
+    // Grow in place, or move to the first fit with the old blocks free, as fs_resize does.
+    // A file that fits nowhere is halved instead.
+    if (size > file.size && space.extentAt(file.start + file.size) < size - file.size)
+    {
+        space.release(file.start, file.size);
+        long start = space.firstFit(size);
+        if (start >= 0)
+        {
+            file.start = (uint32_t)start;
+            space.allocate(file.start, size);
+        }
+        else
+        {
+            space.allocate(file.start, file.size);
+            size = max(file.size / 2, 1u);
+        }
+    }
+    else if (size > file.size)
+    {
+        space.allocate(file.start + file.size, size - file.size);
+    }
+    if (size < file.size)
+    {
+        space.release(file.start + size, file.size - size);
+    }
+    used = used - file.size + size;
+    file.size = size;
+
+    char text[32];
+    snprintf(text, sizeof(text), "E %s %u", file.name, size);
+    line = text;
+}
+
+void Workload::compact()
+{
+    // Files in block order, from every directory
+    vector<pair<uint32_t, uint32_t>> files;
+    vector<uint32_t> below(1, 0);
+    while (!below.empty())
+    {
+        uint32_t node = below.back();
+        const Node &current = nodes[node];
+        below.pop_back();
+        if (current.size > 0)
+        {
+            files.push_back(make_pair(current.start, node));
+        }
+        below.insert(below.end(), current.children.begin(), current.children.end());
+    }
+    sort(files.begin(), files.end());
+
+    uint32_t next = dataStart;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        nodes[files[i].second].start = next;
+        next += nodes[files[i].second].size;
+    }
+    vector<pair<size_t, size_t>> free;
+    if (next < dataStart + capacity)
+    {
+        free.push_back(make_pair((size_t)next, (size_t)(dataStart + capacity - next)));
+    }
+    space.assign(free);
+}
+
+void Workload::move(string &line)
+{
+    uint32_t node;
+    if (cwd != 0 && (pick(2) == 0 || !pickEntry(true, node)))
+    {
+        cwd = nodes[cwd].parent;
+        line = "Y ..";
+        return;
+    }
+    if (!pickEntry(true, node))
+    {
+        // A flat root with nothing to delete or resize
+        create(line);
+        return;
+    }
+    cwd = node;
+    line = string("Y ") + nodes[node].name;
+}
+
+void Workload::access(string &line)
+{
+    uint32_t node;
+    if (!pickEntry(false, node))
+    {
+        create(line);
+        return;
+    }
+
+    char text[64];
+    uint32_t block = pick(nodes[node].size);
+    bool read = pick(100) < params.reads;
+    if (!read && pick(8) == 0)
+    {
+        // A new buffer now and then for the writes that follow
+        snprintf(text, sizeof(text), "B workload %u %u", params.seed, count);
+        line = text;
+        return;
+    }
+    snprintf(text, sizeof(text), "%c %s %u", read ? 'R' : 'W', nodes[node].name, block);
+    line = text;
+
+    // Drawn only when asked for, so the scripts without ranges stay the same
+    if (params.ranges > 0 && pick(100) < params.ranges)
+    {
+        snprintf(text, sizeof(text), " %u", 1 + pick(nodes[node].size - block));
+        line += text;
+    }
+}
+
+void Workload::next(string &line)
+{
+    if (!mounted)
+    {
+        mounted = true;
+        line = "M " + params.disk;
+        return;
+    }
+
+    count++;
+    if (params.defrag > 0 && count % params.defrag == 0)
+    {
+        compact();
+        line = "O";
+        return;
+    }
+    if (pick(100) < params.io)
+    {
+        access(line);
+        return;
+    }
+
+    // Directory changes are part of the metadata commands when there are directories
+    uint32_t moves = params.depth > 0 ? (params.creates + params.deletes + params.resizes) / 10 + 1 : 0;
+    uint32_t roll = pick(params.creates + params.deletes + params.resizes + moves);
+    if (roll < params.creates)
+    {
+        create(line);
+    }
+    else if (roll < params.creates + params.deletes)
+    {
+        remove(line);
+    }
+    else if (roll < params.creates + params.deletes + params.resizes)
+    {
+        resize(line);
+    }
+    else
+    {
+        move(line);
+    }
+}
+
+bool imageStats(const char *path, ImageStats &stats)
+{
+    FS_super_block super_block;
+    if (!readSB(path, &super_block))
+    {
+        return false;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    stats.blocks = super_block.num_blocks;
+    for (uint32_t i = 0; i < super_block.num_inodes; i++)
+    {
+        if (super_block.inode[i].used)
+        {
+            (super_block.inode[i].dir ? stats.directories : stats.files)++;
+        }
+    }
+
+    size_t length;
+    size_t at = super_block.free_block_list.nextRun(super_block.data_start, length);
+    while (at < super_block.free_block_list.size())
+    {
+        stats.extents++;
+        stats.free += length;
+        stats.largest = max<uint64_t>(stats.largest, length);
+        at = super_block.free_block_list.nextRun(at + length, length);
+    }
+    stats.used = super_block.num_blocks - super_block.data_start - stats.free;
+    stats.fragmentation = stats.free == 0 ? 0 : 100.0 * (stats.free - stats.largest) / stats.free;
+    return true;
+}
@@ -0,0 +1,124 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "FreeExtents.h"
+
+/**
+ * Parameters of a synthetic workload, set with key=value arguments (see README)
+ */
+struct WorkloadParams
+{
+    uint32_t seed;
+    uint32_t commands;    // Commands after the mount, the most an aging run takes
+    std::string disk;     // Disk of the M command
+    uint32_t blocks;      // Disk size, for the fill level and new images
+    uint32_t inodes;
+    uint32_t minSize;     // File sizes in blocks
+    uint32_t maxSize;
+    bool logSizes;        // Sizes log-uniform (many small files, few large), uniform otherwise
+    uint32_t depth;       // Deepest directory below the root, 0 for a flat disk
+    uint32_t creates;     // Weights of creates, deletes and resizes
+    uint32_t deletes;
+    uint32_t resizes;
+    uint32_t io;          // Percent of the commands that read or write a block
+    uint32_t reads;       // Percent of those that read
+    uint32_t ranges;      // Percent of the reads and writes that cover a run of blocks
+    uint32_t fill;        // Percent of the data blocks the files should use
+    uint32_t fragmentation; // Aging target, see ImageStats
+    uint32_t defrag;      // An O every defrag commands, 0 for none
+    uint32_t format;      // Layout of the model, 1 or 2, 0 for v1 at 128 blocks and 126 inodes
+
+    WorkloadParams();
+
+    // Sets one key=value parameter, false if the key or the value is not valid
+    bool set(const char *argument);
+};
+
+/**
+ * Deterministic command generator. The same parameters give the same script on every
+ * platform: the generator only uses the raw output of mt19937 (the standard
+ * distributions differ between libraries) and keeps its own model of the disk, so the
+ * script does not depend on what the commands do. The model places files with the
+ * first fit of the file system, grows them in place or moves them like fs_resize and
+ * compacts them like fs_defrag, so on a fresh disk of the same layout no command fails.
+ */
+class Workload
+{
+public:
+    explicit Workload(const WorkloadParams &params);
+
+    // Next line of the script, the first one mounts the disk
+    void next(std::string &line);
+
+private:
+    struct Node
+    {
+        char name[6];
+        bool dir;
+        uint32_t size;
+        uint32_t start; // First block of a file
+        uint32_t parent;
+        uint32_t depth;
+        std::vector<uint32_t> children; // Entries of a directory
+    };
+
+    uint32_t pick(uint32_t bound);
+    uint32_t fileSize();
+    void newName(char prefix, char name[6]);
+
+    // Picks an entry of the current directory, false if there is none of that kind
+    bool pickEntry(bool dir, uint32_t &node);
+
+    void create(std::string &line);
+    void remove(std::string &line);
+    void resize(std::string &line);
+    void move(std::string &line);
+    void access(std::string &line);
+
+    // Drops a node and everything below it from the model
+    void drop(uint32_t node);
+
+    // Moves the files together at the start of the data blocks, like fs_defrag
+    void compact();
+
+    WorkloadParams params;
+    std::vector<Node> nodes; // Node 0 is the root
+    uint32_t cwd;
+    uint32_t live;     // Nodes in use, the root excluded
+    uint64_t used;      // Blocks of the live files
+    uint32_t dataStart; // First data block of the layout
+    uint64_t capacity;  // Data blocks of the disk
+    FreeExtents space;  // Free data blocks of the model
+    uint32_t names;
+    uint32_t count;
+    std::mt19937 random;
+    bool mounted;
+};
+
+/**
+ * Free space of a disk image. Files are contiguous, so the fragmentation of an image is
+ * the one of its free space: the percent of the free data blocks that are not in the
+ * largest free extent (0 for a fresh image).
+ */
+struct ImageStats
+{
+    uint64_t blocks;
+    uint64_t files;
+    uint64_t directories;
+    uint64_t used;    // Data blocks in use
+    uint64_t free;    // Free data blocks
+    uint64_t extents; // Free extents
+    uint64_t largest; // Blocks of the largest free extent
+    double fragmentation;
+};
+
+// Reads the superblock of a v1 or v2 image, false if it cannot be read
+bool imageStats(const char *path, ImageStats &stats);
+
+#endif
@@ -0,0 +1,488 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "FSHelper.h"
+#include "MountTable.h"
+#include "Snapshot.h"
+
+using namespace std;
+
+// Image the benchmarks run on, and its copy for the defragmentation runs
+static const char *IMAGE = "fsbench.img";
+static const char *SCRATCH = "fsbench.tmp";
+
+// Largest file of the generated images, in blocks
+static const int MAX_FILE = 32;
+
+// Inodes kept free for the create benchmark
+static const uint32_t SPARE_INODES = 256;
+
+// One timed operation
+struct Result
+{
+    string name;
+    uint64_t ops;
+    double seconds;
+    bool counted;    // The read and write syscall counts are known
+    uint64_t reads;  // Read syscalls (read, pread, ...)
+    uint64_t writes; // Write syscalls (write, pwrite, ...)
+};
+
+// Read and write syscalls of the process so far, false if /proc/self/io is not there
+static bool syscalls(uint64_t &reads, uint64_t &writes)
+{
+    ifstream io("/proc/self/io");
+    string key;
+    uint64_t value;
+    int found = 0;
+    while (io >> key >> value)
+    {
+        if (key == "syscr:")
+        {
+            reads = value;
+            found++;
+        }
+        else if (key == "syscw:")
+        {
+            writes = value;
+            found++;
+        }
+    }
+    return found == 2;
+}
+
+// Read syscalls of one look at /proc/self/io, taken out of every result
+static uint64_t probeReads = 0;
+
+// Times the calls made between begin() and end(), a result may add several runs
+class Probe
+{
+public:
+    explicit Probe(Result &result) : result(result) {}
+
+    void begin()
+    {
+        counted = syscalls(reads, writes);
+        start = chrono::steady_clock::now();
+    }
+
+    void end()
+    {
+        result.seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        uint64_t r, w;
+        if (counted && syscalls(r, w))
+        {
+            result.reads += r - reads - probeReads;
+            result.writes += w - writes;
+        }
+        else
+        {
+            result.counted = false;
+        }
+    }
+
+private:
+    Result &result;
+    chrono::steady_clock::time_point start;
+    bool counted;
+    uint64_t reads;
+    uint64_t writes;
+};
+
+// Results keep their address, the probes hold them
+static Result &newResult(deque<Result> &results, const char *name, uint64_t ops)
+{
+    Result result = {name, ops, 0, true, 0, 0};
+    results.push_back(result);
+    return results.back();
+}
+
+static void fileName(char prefix, int index, char name[6])
+{
+    snprintf(name, 6, "%c%04x", prefix, index & 0xFFFF);
+}
+
+static bool copyFile(const char *from, const char *to)
+{
+    ifstream in(from, ios::binary);
+    ofstream out(to, ios::binary | ios::trunc);
+    out << in.rdbuf();
+    return in.good() && out.good();
+}
+
+// Superblock of a v2 image as mount reads it, false if it cannot be read
+static bool loadImage(const char *path, FS_super_block &super_block)
+{
+    int FD = open(path, O_RDONLY);
+    if (FD < 0)
+    {
+        return false;
+    }
+    FileDisk disk(FD);
+    char block[1024];
+    Super_block_v2 header;
+    return pread(FD, block, 1024, 0) == 1024 && deserializeHeaderV2(block, &header) &&
+           readSB_v2(&disk, &header, &super_block);
+}
+
+/**
+ * Fills a new image with files of 1 to MAX_FILE blocks up to fill percent of the data
+ * blocks, deletes fragmentation percent of them and fills the holes again with new files.
+ * The file names are f0000, f0001, ...
+ */
+static bool generate(FileSystem &fs, uint32_t blocks, int fill, int fragmentation, mt19937 &random)
+{
+    int FD = open(IMAGE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (FD < 0)
+    {
+        return false;
+    }
+    uint32_t inodes = max(blocks / 16, SPARE_INODES * 2);
+    bool formatted = formatV2(FD, blocks, inodes);
+    close(FD);
+    if (!formatted)
+    {
+        return false;
+    }
+    fs.mount((char *)IMAGE);
+    if (!fs.isMounted())
+    {
+        return false;
+    }
+
+    uint64_t target = (uint64_t)fs.maxSize() * fill / 100;
+    uint32_t files = min(inodes - SPARE_INODES, (uint32_t)0x10000);
+    vector<pair<int, int>> live; // Name index and size of the files
+    uint64_t used = 0;
+    int next = 0;
+    char name[6];
+    for (int round = 0; round < 2; round++)
+    {
+        while (used < target && live.size() < files && next < 0x10000)
+        {
+            int size = 1 + random() % MAX_FILE;
+            fileName('f', next, name);
+            fs.create(name, size);
+            live.push_back(make_pair(next++, size));
+            used += size;
+        }
+        if (round == 1)
+        {
+            break;
+        }
+
+        // Deleted files leave holes all over the disk
+        shuffle(live.begin(), live.end(), random);
+        size_t deleted = live.size() * fragmentation / 100;
+        for (size_t i = 0; i < deleted; i++)
+        {
+            fileName('f', live.back().first, name);
+            fs.remove(name);
+            used -= live.back().second;
+            live.pop_back();
+        }
+    }
+    fs.flush();
+    return true;
+}
+
+static void printResults(const FS_super_block &super_block, int fill, int fragmentation,
+                         const vector<pair<string, int>> &files, const deque<Result> &results)
+{
+    // Free extents of the data blocks
+    size_t extents = 0;
+    size_t length;
+    size_t at = super_block.free_block_list.nextRun(super_block.data_start, length);
+    while (at < super_block.free_block_list.size())
+    {
+        extents++;
+        at = super_block.free_block_list.nextRun(at + length, length);
+    }
+
+    printf("{\n");
+    printf("  \"image\": {\"blocks\": %u, \"inodes\": %u, \"fill\": %d, \"fragmentation\": %d, "
+           "\"files\": %zu, \"used_blocks\": %zu, \"free_extents\": %zu},\n",
+           super_block.num_blocks, super_block.num_inodes, fill, fragmentation, files.size(),
+           super_block.free_block_list.count(), extents);
+    printf("  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &result = results[i];
+        double ns = result.seconds * 1e9 / result.ops;
+        printf("    {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.1f, \"ops_per_sec\": %.1f, ", result.name.c_str(),
+               (unsigned long long)result.ops, ns, result.seconds > 0 ? result.ops / result.seconds : 0.0);
+        if (result.counted)
+        {
+            printf("\"read_syscalls\": %llu, \"write_syscalls\": %llu, \"syscalls_per_op\": %.3f}",
+                   (unsigned long long)result.reads, (unsigned long long)result.writes,
+                   (double)(result.reads + result.writes) / result.ops);
+        }
+        else
+        {
+            printf("\"read_syscalls\": null, \"write_syscalls\": null, \"syscalls_per_op\": null}");
+        }
+        printf("%s\n", i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+// Benchmarks of the file system operations: ./fsbench [blocks] [fill] [fragmentation] [ops]
+int main(int argc, char *argv[])
+{
+    if (argc > 5)
+    {
+        cerr << "usage: ./fsbench [blocks] [fill] [fragmentation] [ops]" << endl;
+        exit(1);
+    }
+    long blocks = argc > 1 ? atol(argv[1]) : 65536;
+    int fill = argc > 2 ? atoi(argv[2]) : 50;
+    int fragmentation = argc > 3 ? atoi(argv[3]) : 30;
+    long ops = argc > 4 ? atol(argv[4]) : 20000;
+    if (blocks < 1024 || blocks > 0x7FFFFFFF || fill < 1 || fill > 90 || fragmentation < 0 || fragmentation > 100 ||
+        ops <= 0)
+    {
+        cerr << "Error: blocks must be at least 1024, fill 1 to 90, fragmentation 0 to 100 and ops positive" << endl;
+        exit(1);
+    }
+
+    // The messages of the commands are not part of the results
+    ostream quiet(nullptr);
+    FileSystem fs;
+    fs.setOutput(quiet, quiet);
+    mt19937 random(1);
+    if (!generate(fs, (uint32_t)blocks, fill, fragmentation, random))
+    {
+        cerr << "Error: cannot create " << IMAGE << "." << endl;
+        exit(1);
+    }
+
+    FS_super_block super_block;
+    if (!loadImage(IMAGE, super_block))
+    {
+        cerr << "Error: cannot read " << IMAGE << "." << endl;
+        exit(1);
+    }
+    vector<pair<string, int>> files;
+    for (uint32_t i = 0; i < super_block.num_inodes; i++)
+    {
+        const FS_inode &inode = super_block.inode[i];
+        if (inode.used && !inode.dir)
+        {
+            files.push_back(make_pair(string(inode.name, strnlen(inode.name, 5)), (int)inode.used_size));
+        }
+    }
+    if (files.empty())
+    {
+        cerr << "Error: no files on " << IMAGE << "." << endl;
+        exit(1);
+    }
+
+    uint64_t reads, writes, after;
+    if (syscalls(reads, writes) && syscalls(after, writes))
+    {
+        probeReads = after - reads;
+    }
+
+    deque<Result> results;
+    long rounds = max(ops / 1000, 5L);
+    char name[6];
+
+    Result &mount = newResult(results, "fs_mount", rounds);
+    Probe probe(mount);
+    for (long i = 0; i < rounds; i++)
+    {
+        probe.begin();
+        fs.mount((char *)IMAGE);
+        probe.end();
+    }
+
+    // The same mounts from the snapshot saved by the unmount before each
+    Result &restore = newResult(results, "fs_mount_snapshot", rounds);
+    {
+        Probe timed(restore);
+        fs.setMountSnapshot(true);
+        for (long i = 0; i < rounds; i++)
+        {
+            fs.unmount();
+            timed.begin();
+            fs.mount((char *)IMAGE);
+            timed.end();
+        }
+        fs.setMountSnapshot(false);
+    }
+
+    Result &check = newResult(results, "ccheck", rounds);
+    {
+        Probe timed(check);
+        timed.begin();
+        for (long i = 0; i < rounds; i++)
+        {
+            ccheck(&super_block);
+        }
+        timed.end();
+    }
+
+    Result &build = newResult(results, "buildFS", rounds);
+    {
+        DirIndex tree;
+        Probe timed(build);
+        timed.begin();
+        for (long i = 0; i < rounds; i++)
+        {
+            buildFS(&super_block, &tree);
+        }
+        timed.end();
+    }
+
+    // Random blocks of random files
+    vector<pair<int, int>> accesses(ops);
+    for (long i = 0; i < ops; i++)
+    {
+        int file = random() % files.size();
+        accesses[i] = make_pair(file, (int)(random() % files[file].second));
+    }
+
+    Result &read = newResult(results, "fs_read", ops);
+    {
+        Probe timed(read);
+        timed.begin();
+        for (long i = 0; i < ops; i++)
+        {
+            fs.read((char *)files[accesses[i].first].first.c_str(), accesses[i].second);
+        }
+        timed.end();
+    }
+
+    // The same reads split over two images open at once, a thread each
+    Result &disks = newResult(results, "fs_read_two_disks", ops);
+    {
+        fs.unmount();
+        if (!copyFile(IMAGE, SCRATCH))
+        {
+            cerr << "Error: cannot create " << SCRATCH << "." << endl;
+            exit(1);
+        }
+        MountTable table;
+        FileSystem *mounted[2] = {table.open(IMAGE), table.open(SCRATCH)};
+        if (mounted[0] == nullptr || mounted[1] == nullptr)
+        {
+            cerr << "Error: cannot mount " << IMAGE << " and " << SCRATCH << "." << endl;
+            exit(1);
+        }
+        Probe timed(disks);
+        timed.begin();
+        vector<thread> pool;
+        for (int d = 0; d < 2; d++)
+        {
+            pool.push_back(thread([&, d]() {
+                for (long i = d; i < ops; i += 2)
+                {
+                    mounted[d]->read((char *)files[accesses[i].first].first.c_str(), accesses[i].second);
+                }
+            }));
+        }
+        for (size_t t = 0; t < pool.size(); t++)
+        {
+            pool[t].join();
+        }
+        timed.end();
+        table.close(IMAGE);
+        table.close(SCRATCH);
+        fs.mount((char *)IMAGE);
+    }
+
+    Result &write = newResult(results, "fs_write", ops);
+    {
+        fs.buff((char *)"fsbench");
+        Probe timed(write);
+        timed.begin();
+        for (long i = 0; i < ops; i++)
+        {
+            fs.write((char *)files[accesses[i].first].first.c_str(), accesses[i].second);
+        }
+        fs.flush();
+        timed.end();
+    }
+
+    // One block files in the spare inodes, then the same files deleted
+    long created = min(ops, (long)SPARE_INODES);
+    Result &create = newResult(results, "fs_create", created);
+    {
+        Probe timed(create);
+        timed.begin();
+        for (long i = 0; i < created; i++)
+        {
+            fileName('n', i, name);
+            fs.create(name, 1);
+        }
+        timed.end();
+    }
+    Result &remove = newResult(results, "fs_delete", created);
+    {
+        Probe timed(remove);
+        timed.begin();
+        for (long i = 0; i < created; i++)
+        {
+            fileName('n', i, name);
+            fs.remove(name);
+        }
+        timed.end();
+    }
+
+    // Every file grows by one block, which may move it, then shrinks back
+    long resized = min(ops / 2, (long)files.size()) * 2;
+    Result &resize = newResult(results, "fs_resize", resized);
+    {
+        Probe timed(resize);
+        timed.begin();
+        for (long i = 0; i < resized / 2; i++)
+        {
+            fs.resize((char *)files[i].first.c_str(), files[i].second + 1);
+            fs.resize((char *)files[i].first.c_str(), files[i].second);
+        }
+        fs.flush();
+        timed.end();
+    }
+
+    // Every run compacts a fresh copy of the image
+    long defrags = 5;
+    Result &defrag = newResult(results, "fs_defrag", defrags);
+    {
+        Probe timed(defrag);
+        for (long i = 0; i < defrags; i++)
+        {
+            fs.unmount();
+            if (!copyFile(IMAGE, SCRATCH))
+            {
+                cerr << "Error: cannot create " << SCRATCH << "." << endl;
+                exit(1);
+            }
+            fs.mount((char *)SCRATCH);
+            timed.begin();
+            fs.defrag();
+            fs.flush();
+            timed.end();
+            fs.mount((char *)IMAGE);
+        }
+    }
+
+    fs.unmount();
+    unlink(SCRATCH);
+    unlink(IMAGE);
+    unlink(Snapshot::path(IMAGE).c_str());
+    printResults(super_block, fill, fragmentation, files, results);
+    return 0;
+}
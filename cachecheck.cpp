@@ -0,0 +1,135 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "BlockCache.h"
+#include "Disk.h"
+
+using namespace std;
+
+// Blocks of the scratch image
+static const uint64_t BLOCKS = 4096;
+
+/**
+ * Differential check of the block cache. Runs random block writes, range writes, zeroing,
+ * moves and range reads on a cache in front of a scratch image and the same operations on
+ * an in-memory copy of the image, and compares every block read and the image after the
+ * last flush with the copy. A move leaves its source blocks undefined (the cache renames
+ * them, a dirty one is never written back), so they are not compared until written again.
+ * Runs are mostly shorter than the cache and sometimes longer, so both the index lookups
+ * and the frame scans are taken.
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 5)
+    {
+        cerr << "usage: ./cachecheck scratch_disk [operations] [frames] [seed]" << endl;
+        exit(1);
+    }
+    long operations = argc > 2 ? atol(argv[2]) : 200000;
+    long frames = argc > 3 ? atol(argv[3]) : 64;
+    uint32_t seed = argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 10) : 1;
+    if (operations <= 0 || frames <= 0)
+    {
+        cerr << "Error: invalid operation or frame count" << endl;
+        exit(1);
+    }
+
+    int FD = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (FD < 0 || ftruncate(FD, BLOCKS * 1024) < 0)
+    {
+        cerr << "Error: cannot create " << argv[1] << "." << endl;
+        exit(1);
+    }
+    FileDisk disk(FD);
+    BlockCache cache(frames);
+    cache.attach(&disk);
+
+    vector<char> model(BLOCKS * 1024, 0);
+    vector<bool> known(BLOCKS, true);
+    vector<char> buffer(BLOCKS * 1024);
+    mt19937 random(seed);
+    uint64_t bad = 0;
+    for (long op = 0; op < operations; op++)
+    {
+        // A run mostly shorter than the cache, one in four up to 96 blocks
+        uint64_t count = 1 + random() % (random() % 4 != 0 ? 8 : 96);
+        uint64_t block = random() % (BLOCKS - count);
+        bool done = true;
+        switch (random() % 6)
+        {
+        case 0:
+            memset(&buffer[0], (int)random(), 1024);
+            done = cache.write(block, &buffer[0]);
+            memcpy(&model[block * 1024], &buffer[0], 1024);
+            known[block] = true;
+            break;
+        case 1:
+            for (uint64_t i = 0; i < count; i++)
+            {
+                memset(&buffer[i * 1024], (int)random(), 1024);
+            }
+            done = cache.writeRange(block, count, &buffer[0]);
+            memcpy(&model[block * 1024], &buffer[0], count * 1024);
+            fill(known.begin() + block, known.begin() + block + count, true);
+            break;
+        case 2:
+            done = cache.zero(block, count);
+            memset(&model[block * 1024], 0, count * 1024);
+            fill(known.begin() + block, known.begin() + block + count, true);
+            break;
+        case 3:
+        {
+            uint64_t to = random() % (BLOCKS - count);
+            done = cache.move(block, to, count);
+            memmove(&model[to * 1024], &model[block * 1024], count * 1024);
+            vector<bool> moved(known.begin() + block, known.begin() + block + count);
+            fill(known.begin() + block, known.begin() + block + count, false);
+            copy(moved.begin(), moved.end(), known.begin() + to);
+            break;
+        }
+        default:
+            done = cache.readRange(block, count, &buffer[0]);
+            for (uint64_t i = 0; i < count; i++)
+            {
+                if (known[block + i] && memcmp(&buffer[i * 1024], &model[(block + i) * 1024], 1024) != 0)
+                {
+                    bad++;
+                }
+            }
+            break;
+        }
+        if (!done)
+        {
+            cerr << "Error: cannot access " << argv[1] << "." << endl;
+            exit(1);
+        }
+    }
+
+    // What the cache still holds must reach the image
+    if (!cache.flush() || !disk.read(0, &buffer[0], BLOCKS * 1024))
+    {
+        cerr << "Error: cannot access " << argv[1] << "." << endl;
+        exit(1);
+    }
+    for (uint64_t block = 0; block < BLOCKS; block++)
+    {
+        if (known[block] && memcmp(&buffer[block * 1024], &model[block * 1024], 1024) != 0)
+        {
+            bad++;
+        }
+    }
+    cache.attach(nullptr);
+
+    printf("%ld operations on %ld frames, %llu blocks differ from the model.\n", operations, frames,
+           (unsigned long long)bad);
+    return bad == 0 ? 0 : 1;
+}
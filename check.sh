@@ -0,0 +1,76 @@
+#!/bin/sh
+# Differential checks. cachecheck compares the block cache with a model of the image.
+# Every workload script runs on a fresh disk in the default mode, then again on a fresh
+# disk with each of MODES set; stdout, stderr and the final image must be the same. Run by
+# make check, from the directory of the binaries.
+
+root=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Environment of every mode compared with the default one, commas between the variables
+# of one mode
+MODES="FS_MMAP=1 FS_DEFERRED_ZERO=1 FS_MMAP=1,FS_DEFERRED_ZERO=1 FS_BATCH=1 FS_BATCH=1,FS_DEFERRED_ZERO=1 FS_CACHE=0 FS_CACHE=16"
+
+# Modes run as the one job of ./fs -b, whose jobs must take the options too
+BATCH_MODES="FS_CACHE=256 FS_MMAP=1,FS_DEFERRED_ZERO=1,FS_BATCH=1,FS_CACHE=16"
+
+failed=0
+
+# run <format command> <output suffix> [environment] [fs arguments]: runs $dir/script on a
+# fresh $dir/disk, without the last stderr line of a batch (its time)
+run()
+{
+    rm -f "$dir/disk" "$dir/disk.snap"
+    (cd "$dir" && $1 > /dev/null && chmod 600 disk) || exit 1
+    (cd "$dir" && env $(echo "$3" | tr , ' ') "$root/fs" ${4:-script} > "out.$2" 2> "err.$2")
+    sed -i '/^Batch: /d' "$dir/err.$2"
+    mv "$dir/disk" "$dir/disk.$2"
+}
+
+# compare <name> <mode>: the outputs and the image of the mode against the default ones
+compare()
+{
+    for file in out err disk
+    do
+        if ! cmp -s "$dir/$file.default" "$dir/$file.mode"
+        then
+            echo "$1 $2: $file differs"
+            failed=1
+        fi
+    done
+}
+
+# check <name> <format command> <workload parameters>
+check()
+{
+    "$root/workload" script disk=disk $3 > "$dir/script" || exit 1
+    echo "script disk" > "$dir/manifest"
+    run "$2" default
+    for mode in $MODES
+    do
+        run "$2" mode "$mode"
+        compare "$1" "$mode"
+    done
+    for mode in $BATCH_MODES
+    do
+        run "$2" mode "$mode" "-b manifest 1"
+        compare "$1" "-b $mode"
+    done
+    echo "$1: $(wc -l < "$dir/script") commands"
+}
+
+# The block cache against an in-memory image first, on the default and a tiny cache
+"$root/cachecheck" "$dir/cache" || failed=1
+"$root/cachecheck" "$dir/cache" 50000 4 2 || failed=1
+
+check v1 "$root/create_fs disk" "blocks=128 inodes=126 commands=2000 seed=1 defrag=100 ranges=30"
+check v2 "$root/mkfs disk 4096 512" "blocks=4096 inodes=512 commands=4000 seed=2 defrag=500 ranges=30"
+check v2-flat "$root/mkfs disk 4096 512" "blocks=4096 inodes=512 commands=4000 seed=3 depth=0 sizes=1:8 fill=90 ranges=30"
+
+if [ $failed -ne 0 ]
+then
+    echo "Modes differ from the default one."
+    exit 1
+fi
+echo "All modes match the default one."
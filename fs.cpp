@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <cstdint>
+#include <cstdlib>
 #include <cassert>
 #include <iostream>
 #include <fstream>
@@ -9,195 +10,189 @@
 #include <vector>
 
 #include "FileSystem.h"
-#include "Helper.h"
+#include "FSHelper.h"
+#include "Script.h"
+#include "Batch.h"
+#include "Timeline.h"
+#include "Trace.h"
 
 using namespace std;
 
+// Format of the counters printed at exit
+static bool metricsJSON = false;
+
+static void printMetrics()
+{
+    fs_default().metrics().print(cerr, metricsJSON);
+}
+
+// Chrome trace-event file of the timeline, written at exit
+static const char *timelinePath = NULL;
+
+static void writeTimeline()
+{
+    Timeline::stop();
+    if (!Timeline::write(timelinePath))
+    {
+        cerr << "Timeline is not written." << endl;
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    // If the user doesn't not provide any input file(s)
-    if (argc != 2)
+    // FS_METRICS=text or FS_METRICS=json prints the counters of the disk commands to stderr at exit
+    const char *metrics = getenv("FS_METRICS");
+    if (metrics != NULL && (strcmp(metrics, "text") == 0 || strcmp(metrics, "json") == 0))
     {
-        cerr << "usage: ./fs input_disk" << endl;
-        exit(1);
+        metricsJSON = strcmp(metrics, "json") == 0;
+        // Constructed first, so it is still there when the handler runs
+        fs_default();
+        atexit(printMetrics);
     }
-    ifstream disk(argv[1]);
-    if (!disk.is_open())
+
+    // FS_TIMELINE=file records a timeline of the commands and their disk calls into file
+    timelinePath = getenv("FS_TIMELINE");
+    if (timelinePath != NULL && *timelinePath != '\0')
     {
-        cerr << "Disk is not opened." << endl;
+        Timeline::start();
+        atexit(writeTimeline);
     }
 
-    // Get arguments
-    vector<string> arguments;
-    string arg;
-    int line_counter = 0;
+    // The other options apply to the default instance and to every job of -b
+    BatchSettings settings;
+
+    // FS_SNAPSHOT=1 saves the derived state of the disk at unmount and loads it at the next mount
+    const char *snapshot = getenv("FS_SNAPSHOT");
+    settings.mountSnapshot = snapshot != NULL && strcmp(snapshot, "1") == 0;
+
+    // FS_MMAP=1 mounts the disks with mmap instead of pread/pwrite
+    const char *mapped = getenv("FS_MMAP");
+    settings.mountMmap = mapped != NULL && strcmp(mapped, "1") == 0;
+
+    // FS_DEFERRED_ZERO=1 queues the freed blocks and zeroes them at the flush points
+    const char *deferred = getenv("FS_DEFERRED_ZERO");
+    settings.deferredZero = deferred != NULL && strcmp(deferred, "1") == 0;
 
-    while (!disk.eof())
+    // FS_CACHE=blocks sets the block cache to that many 1KB blocks, 0 turns it off
+    const char *cache = getenv("FS_CACHE");
+    if (cache != NULL && *cache != '\0' && strspn(cache, "0123456789") == strlen(cache))
     {
-        line_counter++;
-        getline(disk, arg);
-        arguments = tokenize(arg, " ");
+        settings.cache = true;
+        settings.cacheCapacity = strtoul(cache, NULL, 10);
+    }
 
-        char command = arg[0];
-        switch (command)
-        {
-        case 'M':
-            if (arguments.size() != 2)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            fs_mount((char *)arguments[1].c_str());
-            break;
-        case 'C':
-            if (arguments.size() != 3)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            if (atoi(arguments[2].c_str()) < 0 || atoi(arguments[2].c_str()) > 127)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            if (arguments[1].size() > 5)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            fs_create((char *)arguments[1].c_str(), atoi(arguments[2].c_str()));
-            break;
-        case 'D':
-            if (arguments.size() != 2)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            if (arguments[1].size() > 5)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
+    // FS_BATCH=1 holds the superblock writes of a script or trace back until it ends
+    const char *batch = getenv("FS_BATCH");
+    settings.batchWrites = batch != NULL && strcmp(batch, "1") == 0;
 
-            fs_delete((char *)arguments[1].c_str());
-            break;
-        case 'R':
-            if (arguments.size() != 3)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            if (atoi(arguments[2].c_str()) < 0 || atoi(arguments[2].c_str()) > 127)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            if (arguments[1].size() > 5)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            fs_read((char *)arguments[1].c_str(), atoi(arguments[2].c_str()));
-            break;
-        case 'W':
-            if (arguments.size() != 3)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            if (atoi(arguments[2].c_str()) < 0 || atoi(arguments[2].c_str()) > 127)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            if (arguments[1].size() > 5)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            fs_write((char *)arguments[1].c_str(), atoi(arguments[2].c_str()));
-            break;
-        case 'B':
+    // ./fs -b manifest [threads] runs many scripts at once, their counters go to the exit report
+    if (argc >= 3 && argc <= 4 && strcmp(argv[1], "-b") == 0)
+    {
+        int threads = argc == 4 ? atoi(argv[3]) : 0;
+        settings.metrics = &fs_default().metrics();
+        return runBatch(argv[2], threads, settings);
+    }
+    settings.apply(fs_default());
+
+    // ./fs -k disk lists every violation of the consistency rules
+    if (argc == 3 && strcmp(argv[1], "-k") == 0)
+    {
+        FS_super_block super_block;
+        if (!readSB(argv[2], &super_block))
         {
-            if (arguments.size() == 1)
+            // Missing, too short, or a v2 header without a usable layout
+            cerr << "Error: Cannot read disk " << argv[2] << "." << endl;
+            return 1;
+        }
+        vector<FS_violation> violations;
+        int code = ccheck(&super_block, &violations);
+        for (size_t i = 0; i < violations.size(); i++)
+        {
+            cout << "Rule " << violations[i].code;
+            if (violations[i].inode == FS_NO_INODE)
             {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
+                cout << ": free-space list" << endl;
             }
-            string::iterator it = arg.begin();
-            // Skip the first character
-            it++;
-            while (*it == ' ')
+            else
             {
-                it++;
+                cout << ": inode " << violations[i].inode << endl;
             }
-            arg.erase(arg.begin(), it);
+        }
+        if (code > 0)
+        {
+            cerr << "Error: File system in " << argv[2] << " is inconsistent (error code: " << code << ")" << endl;
+            return 1;
+        }
+        return 0;
+    }
 
-            if (arg.size() > 1024)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            fs_buff((char *)arg.c_str());
+    // ./fs -c script trace compiles a script into a binary trace
+    if (argc == 4 && strcmp(argv[1], "-c") == 0)
+    {
+        if (compileTrace(argv[2], argv[3]) < 0)
+        {
+            cerr << "Trace is not written." << endl;
+            return 1;
         }
-        break;
-        case 'L':
-            if (arguments.size() > 1)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            fs_ls();
-            break;
-        case 'E':
-            if (arguments.size() != 3)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            if ((atoi(arguments[2].c_str()) > 127))
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
+        return 0;
+    }
 
-            if (arguments[1].size() > 5)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            fs_resize((char *)arguments[1].c_str(), atoi(arguments[2].c_str()));
-            break;
-        case 'O':
-            if (arguments.size() > 1)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            fs_defrag();
-            break;
-        case 'Y':
-            if (arguments.size() != 2)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            if (arguments[1].size() > 5)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-                continue;
-            }
-            fs_cd((char *)arguments[1].c_str());
-            break;
-        default:
-            if (arg.size() != 0)
-            {
-                cerr << "Command Error: " << argv[1] << ", " << line_counter << endl;
-            }
-            break;
+    // ./fs -t trace replays a compiled trace
+    if (argc == 3 && strcmp(argv[1], "-t") == 0)
+    {
+        Trace trace;
+        if (!trace.load(argv[2]))
+        {
+            cerr << "Trace is not valid." << endl;
+            return 1;
+        }
+        if (settings.batchWrites)
+        {
+            fs_batch_begin();
+        }
+        replayTrace(fs_default(), trace, cerr);
+        if (settings.batchWrites)
+        {
+            fs_batch_end();
         }
+        fs_free();
+        return 0;
+    }
+
+    // If the user doesn't not provide any input file(s)
+    bool record = argc == 4 && strcmp(argv[1], "-r") == 0;
+    if (argc != 2 && !record)
+    {
+        cerr << "usage: ./fs input_disk" << endl;
+        cerr << "       ./fs -b manifest [threads]" << endl;
+        cerr << "       ./fs -k input_disk" << endl;
+        cerr << "       ./fs -c script trace | -t trace | -r trace script" << endl;
+        exit(1);
+    }
+    // ./fs -r trace script runs the script and records the trace of what it ran
+    const char *script = record ? argv[3] : argv[1];
+    ifstream disk(script);
+    if (!disk.is_open())
+    {
+        cerr << "Disk is not opened." << endl;
+    }
+
+    TraceWriter trace(script);
+    if (settings.batchWrites)
+    {
+        fs_batch_begin();
+    }
+    runScript(fs_default(), disk, script, cerr, record ? &trace : nullptr);
+    if (settings.batchWrites)
+    {
+        fs_batch_end();
     }
     disk.close();
     fs_free();
+    if (record && !trace.save(argv[2]))
+    {
+        cerr << "Trace is not written." << endl;
+        return 1;
+    }
     return 0;
 }
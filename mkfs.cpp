@@ -0,0 +1,55 @@
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "FSHelper.h"
+
+using namespace std;
+
+// Creates an empty format v2 disk: ./mkfs <disk_name> [blocks] [inodes]
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4)
+    {
+        cerr << "usage: ./mkfs disk_name [blocks] [inodes]" << endl;
+        exit(1);
+    }
+
+    // Defaults to a 64MB disk
+    long blocks = 65536;
+    long inodes = 4096;
+    if (argc > 2)
+    {
+        blocks = atol(argv[2]);
+    }
+    if (argc > 3)
+    {
+        inodes = atol(argv[3]);
+    }
+    if (blocks <= 0 || blocks > 0x7FFFFFFF || inodes <= 0 || inodes >= (long)FS_V2_ROOT)
+    {
+        cerr << "Error: invalid disk size" << endl;
+        exit(1);
+    }
+
+    int FD = open(argv[1], O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (FD < 0)
+    {
+        cerr << "Error: cannot create " << argv[1] << "." << endl;
+        exit(1);
+    }
+
+    if (!formatV2(FD, (uint32_t)blocks, (uint32_t)inodes))
+    {
+        cerr << "Error: cannot format " << argv[1] << " with " << blocks << " blocks and " << inodes << " inodes." << endl;
+        close(FD);
+        exit(1);
+    }
+    close(FD);
+
+    cout << "Disk " << argv[1] << " is created (v2, " << blocks << " blocks, " << inodes << " inodes)." << endl;
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "FileSystem.h"
+
+using namespace std;
+
+// Files read by the benchmark, the first one is read by every thread
+static const int FILES = 8;
+
+// Contents of block block of file file
+static void stamp(int file, int block, char *buffer)
+{
+    memset(buffer, 0, 1024);
+    snprintf(buffer, 1024, "stress file %d block %d", file, block);
+}
+
+static void fileName(int file, char name[6])
+{
+    snprintf(name, 6, "st%d", file);
+}
+
+// Random single block reads of the files for seconds, returns the number of reads
+static uint64_t readers(FileSystem &fs, int threads, int blocks, double seconds, atomic<uint64_t> &errors)
+{
+    atomic<bool> stop(false);
+    atomic<uint64_t> reads(0);
+    vector<thread> pool;
+    for (int t = 0; t < threads; t++)
+    {
+        pool.push_back(thread([&, t]() {
+            mt19937 random(t + 1);
+            char buffer[1024];
+            char expected[1024];
+            char name[6];
+            uint64_t count = 0;
+            while (!stop.load(memory_order_relaxed))
+            {
+                // Half of the reads go to the same file
+                int file = random() % 2 == 0 ? 0 : random() % FILES;
+                int block = random() % blocks;
+                fileName(file, name);
+                fs.readRange(name, block, 1, buffer);
+                stamp(file, block, expected);
+                if (memcmp(buffer, expected, 1024) != 0)
+                {
+                    errors++;
+                }
+                count++;
+            }
+            reads += count;
+        }));
+    }
+    this_thread::sleep_for(chrono::duration<double>(seconds));
+    stop = true;
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+        pool[i].join();
+    }
+    return reads;
+}
+
+// Read throughput of concurrent readers against one mounted disk: ./stress <disk_name> [threads] [seconds]
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4)
+    {
+        cerr << "usage: ./stress disk_name [threads] [seconds]" << endl;
+        exit(1);
+    }
+    int maxThreads = argc > 2 ? atoi(argv[2]) : (int)thread::hardware_concurrency();
+    double seconds = argc > 3 ? atof(argv[3]) : 1.0;
+    if (maxThreads <= 0 || seconds <= 0)
+    {
+        cerr << "Error: invalid thread count or duration" << endl;
+        exit(1);
+    }
+
+    FileSystem fs;
+    fs.mount(argv[1]);
+    if (!fs.isMounted())
+    {
+        exit(1);
+    }
+
+    // Small files on a v1 disk, 64 blocks each on a larger one
+    int blocks = fs.maxSize() > 127 ? 64 : 8;
+    vector<char> run(blocks * 1024);
+    char name[6];
+    for (int file = 0; file < FILES; file++)
+    {
+        fileName(file, name);
+        fs.create(name, blocks);
+        for (int block = 0; block < blocks; block++)
+        {
+            stamp(file, block, &run[block * 1024]);
+        }
+        fs.writeRange(name, 0, blocks, run.data());
+    }
+
+    fs.setConcurrent(true);
+    atomic<uint64_t> errors(0);
+    double single = 0;
+    for (int threads = 1; threads <= maxThreads; threads = threads * 2 > maxThreads && threads < maxThreads ? maxThreads : threads * 2)
+    {
+        double rate = readers(fs, threads, blocks, seconds, errors) / seconds;
+        if (threads == 1)
+        {
+            single = rate;
+        }
+        printf("%3d threads: %12.0f reads/s  %5.2fx\n", threads, rate, single > 0 ? rate / single : 0.0);
+    }
+
+    // Readers again, while a writer rewrites the files and a resize grows and shrinks one
+    atomic<bool> stop(false);
+    thread writer([&]() {
+        vector<char> blocksOut(blocks * 1024);
+        char file[6];
+        for (int round = 0; !stop; round++)
+        {
+            int f = round % FILES;
+            fileName(f, file);
+            for (int block = 0; block < blocks; block++)
+            {
+                stamp(f, block, &blocksOut[block * 1024]);
+            }
+            fs.writeRange(file, 0, blocks, blocksOut.data());
+        }
+    });
+    thread resizer([&]() {
+        char file[6] = "st0";
+        for (int round = 0; !stop; round++)
+        {
+            fs.resize(file, round % 2 == 0 ? blocks * 2 : blocks);
+        }
+        fs.resize(file, blocks);
+    });
+    double mixed = readers(fs, maxThreads, blocks, seconds, errors) / seconds;
+    stop = true;
+    writer.join();
+    resizer.join();
+    printf("%3d threads: %12.0f reads/s  with a writer and a resize\n", maxThreads, mixed);
+    printf("%llu bad reads\n", (unsigned long long)errors.load());
+
+    fs.setConcurrent(false);
+    for (int file = 0; file < FILES; file++)
+    {
+        fileName(file, name);
+        fs.remove(name);
+    }
+    fs.unmount();
+    return errors == 0 ? 0 : 1;
+}
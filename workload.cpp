@@ -0,0 +1,134 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "FSHelper.h"
+#include "Script.h"
+#include "Workload.h"
+
+using namespace std;
+
+// Commands run between two fragmentation checks of an aging run
+static const uint32_t AGING_STEP = 1000;
+
+static void usage()
+{
+    cerr << "usage: ./workload script [key=value ...]" << endl;
+    cerr << "       ./workload age disk_name [key=value ...]" << endl;
+    exit(1);
+}
+
+/**
+ * Synthetic workloads. "script" prints a command script, "age" formats a v2 disk and runs
+ * the workload on it until its free space is fragmented enough (see README).
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        usage();
+    }
+    bool age = strcmp(argv[1], "age") == 0;
+    if (!age && strcmp(argv[1], "script") != 0)
+    {
+        usage();
+    }
+    if (age && argc < 3)
+    {
+        usage();
+    }
+
+    WorkloadParams params;
+    if (age)
+    {
+        params.disk = argv[2];
+    }
+    for (int i = age ? 3 : 2; i < argc; i++)
+    {
+        if (!params.set(argv[i]))
+        {
+            cerr << "Error: invalid parameter " << argv[i] << endl;
+            exit(1);
+        }
+    }
+
+    // An aging run formats a v2 disk, whatever its size
+    if (age)
+    {
+        params.format = 2;
+    }
+
+    Workload workload(params);
+    string line;
+    if (!age)
+    {
+        for (uint32_t i = 0; i <= params.commands; i++)
+        {
+            workload.next(line);
+            cout << line << '\n';
+        }
+        return 0;
+    }
+
+    int FD = open(params.disk.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (FD < 0)
+    {
+        cerr << "Error: cannot create " << params.disk << "." << endl;
+        exit(1);
+    }
+    if (!formatV2(FD, params.blocks, params.inodes))
+    {
+        cerr << "Error: cannot format " << params.disk << " with " << params.blocks << " blocks and " << params.inodes
+             << " inodes." << endl;
+        close(FD);
+        exit(1);
+    }
+    close(FD);
+
+    // The messages of the commands are not wanted, the aged image is
+    ostream quiet(nullptr);
+    FileSystem fs;
+    fs.setOutput(quiet, quiet);
+
+    // The first batch starts with the mount
+    string batch;
+    workload.next(batch);
+    batch += '\n';
+
+    ImageStats stats;
+    uint32_t done = 0;
+    do
+    {
+        // One batch of commands through the interpreter
+        for (uint32_t i = 0; i < AGING_STEP && done < params.commands; i++)
+        {
+            workload.next(line);
+            batch += line;
+            batch += '\n';
+            done++;
+        }
+        istringstream script(batch);
+        runScript(fs, script, params.disk.c_str(), quiet);
+        fs.flush();
+        batch.clear();
+
+        if (!imageStats(params.disk.c_str(), stats))
+        {
+            cerr << "Error: cannot read " << params.disk << "." << endl;
+            exit(1);
+        }
+    } while (done < params.commands && stats.fragmentation < params.fragmentation);
+    fs.unmount();
+
+    printf("Disk %s is aged (%u commands, %llu files, %llu directories, %llu blocks in use, %llu free extents, "
+           "%.1f%% fragmentation).\n",
+           params.disk.c_str(), done, (unsigned long long)stats.files, (unsigned long long)stats.directories,
+           (unsigned long long)stats.used, (unsigned long long)stats.extents, stats.fragmentation);
+    return 0;
+}